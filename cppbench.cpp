@@ -0,0 +1,501 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Benchmark for the C++ interface. A volume is built in memory, and its
+ * directory is listed repeatedly, once through ufat.hpp and once through a
+ * wrapper which copies each entry's name into a std::string. Heap
+ * allocations are counted by replacing the global operator new.
+ *
+ * Records are then streamed into a file through ufat_stream.hpp, and
+ * through a streambuf with a small buffer, and device requests are
+ * compared. The file is read back and checked, sequentially and at random
+ * positions.
+ */
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <new>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "ufat_stream.hpp"
+
+static unsigned long num_allocs;
+
+void *operator new(std::size_t size)
+{
+	void *p = std::malloc(size ? size : 1);
+
+	if (!p)
+		throw std::bad_alloc();
+
+	num_allocs++;
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+struct mem_device {
+	ufat_device		base;
+	std::vector<uint8_t>	data;
+};
+
+static int mem_read(const ufat_device *dev, ufat_block_t start,
+		    ufat_block_t count, void *buffer)
+{
+	const mem_device *m = reinterpret_cast<const mem_device *>(dev);
+
+	std::memcpy(buffer, m->data.data() + (start << dev->log2_block_size),
+		    count << dev->log2_block_size);
+	return 0;
+}
+
+static int mem_write(const ufat_device *dev, ufat_block_t start,
+		     ufat_block_t count, const void *buffer)
+{
+	const mem_device *m = reinterpret_cast<const mem_device *>(dev);
+
+	std::memcpy(const_cast<uint8_t *>(m->data.data()) +
+		    (start << dev->log2_block_size), buffer,
+		    count << dev->log2_block_size);
+	return 0;
+}
+
+/* The sort of wrapper this interface replaces */
+struct naive_entry {
+	ufat_dirent	info;
+	std::string	name;
+};
+
+static int naive_list(ufat_directory *dir, std::vector<naive_entry> &out)
+{
+	ufat_dir_rewind(dir);
+	out.clear();
+
+	for (;;) {
+		naive_entry e;
+		char name[UFAT_LFN_MAX_UTF8];
+		const int err = ufat_dir_read(dir, &e.info, name, sizeof(name));
+
+		if (err)
+			return err < 0 ? err : 0;
+
+		e.name = name;
+		out.push_back(std::move(e));
+	}
+}
+
+static double elapsed(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+static int populate(ufatpp::volume &v, ufatpp::directory &dir,
+		    unsigned int num_files)
+{
+	const std::array<char, 100> record = { };
+	ufat_dirent ent;
+	int err;
+
+	err = v.root().create_directory("logs", ent);
+	if (err >= 0)
+		err = ufatpp::directory::open(v, ent, dir);
+	if (err < 0) {
+		std::fprintf(stderr, "logs: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < num_files; i++) {
+		char name[64];
+		ufatpp::file f;
+
+		std::snprintf(name, sizeof(name), "sensor-log-%05u.csv", i);
+		err = dir.create_file(name, ent);
+		if (err >= 0)
+			err = f.open(v, ent);
+		if (err >= 0)
+			err = f.write(record);
+		if (err < 0) {
+			std::fprintf(stderr, "%s: %s\n", name,
+				     ufat_strerror(err));
+			return -1;
+		}
+	}
+
+	return v.sync();
+}
+
+/* The sort of streambuf this adapter replaces: each overflow is passed
+ * straight to ufat_file_write().
+ */
+class naive_filebuf : public std::streambuf {
+public:
+	int open(ufatpp::volume &v, const ufat_dirent &ent) noexcept
+	{
+		setp(buf_, buf_ + sizeof(buf_));
+		return f_.open(v, ent);
+	}
+
+protected:
+	int_type overflow(int_type c) override
+	{
+		if (sync() < 0)
+			return traits_type::eof();
+
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+
+		return traits_type::not_eof(c);
+	}
+
+	int sync() override
+	{
+		const int err = f_.write(ufatpp::const_byte_span(pbase(),
+					 pptr() - pbase()));
+
+		setp(buf_, buf_ + sizeof(buf_));
+		return err < 0 ? -1 : 0;
+	}
+
+private:
+	ufatpp::file	f_;
+	char		buf_[64];
+};
+
+static const unsigned int record_len = 32;
+
+static void make_record(char *out, unsigned int i)
+{
+	std::snprintf(out, record_len + 1, "record %08u val %011u\n",
+		      i, i * 2654435761u);
+}
+
+template <typename Buf>
+static int stream_records(ufatpp::volume &v, ufatpp::directory &dir,
+			  const char *name, Buf &buf, unsigned int count,
+			  ufat_dirent &ent)
+{
+	std::ostream out(&buf);
+	int err;
+
+	err = dir.create_file(name, ent);
+	if (err < 0)
+		return err;
+
+	err = buf.open(v, ent);
+	if (err < 0)
+		return err;
+
+	for (unsigned int i = 0; i < count; i++) {
+		char rec[record_len + 1];
+
+		make_record(rec, i);
+		out.write(rec, record_len);
+	}
+
+	out.flush();
+	return out ? 0 : -UFAT_ERR_IO;
+}
+
+static int stream_bench(ufatpp::volume &v, ufatpp::directory &dir,
+			unsigned int count)
+{
+	static char window[65536];
+	const ufat_stat *st = &v.get()->stat;
+	ufat_dirent ent;
+	ufatpp::filebuf fb;
+	naive_filebuf nb;
+	unsigned int writes;
+	unsigned int blocks;
+	int err;
+
+	writes = st->write;
+	blocks = st->write_blocks;
+	auto start = std::chrono::steady_clock::now();
+
+	err = stream_records(v, dir, "naive.dat", nb, count, ent);
+	if (err >= 0)
+		err = v.sync();
+	if (err < 0) {
+		std::fprintf(stderr, "naive.dat: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	std::printf("Small buffer:       %u writes, %u blocks, %.3f s\n",
+		    st->write - writes, st->write_blocks - blocks,
+		    elapsed(start));
+
+	/* The adapter, through an ostream */
+	std::ostream out(&fb);
+
+	writes = st->write;
+	blocks = st->write_blocks;
+	start = std::chrono::steady_clock::now();
+
+	err = dir.create_file("stream.dat", ent);
+	if (err >= 0)
+		err = fb.open(v, ent, window);
+	if (err < 0) {
+		std::fprintf(stderr, "stream.dat: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		char rec[record_len + 1];
+
+		make_record(rec, i);
+		out.write(rec, record_len);
+	}
+
+	err = fb.close();
+	if (err >= 0)
+		err = v.sync();
+	if (err < 0) {
+		std::fprintf(stderr, "stream.dat: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	std::printf("%5zu byte window:  %u writes, %u blocks, %.3f s\n",
+		    fb.window_size(), st->write - writes,
+		    st->write_blocks - blocks, elapsed(start));
+
+	/* Read it back in order */
+	std::istream in(&fb);
+
+	err = dir.find("stream.dat", ent);
+	if (!err)
+		err = fb.open(v, ent, window);
+	if (err) {
+		std::fprintf(stderr, "stream.dat: %s\n",
+			     err < 0 ? ufat_strerror(err) : "not found");
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		char expect[record_len + 1];
+		char rec[record_len + 1];
+
+		make_record(expect, i);
+		if (!in.read(rec, record_len) ||
+		    std::memcmp(rec, expect, record_len)) {
+			std::fprintf(stderr, "record %u: mismatch\n", i);
+			return -1;
+		}
+	}
+
+	if (in.get() != std::istream::traits_type::eof()) {
+		std::fprintf(stderr, "stream.dat: trailing data\n");
+		return -1;
+	}
+
+	/* Read records at random positions */
+	uint32_t seed = 1;
+
+	in.clear();
+	start = std::chrono::steady_clock::now();
+
+	for (unsigned int n = 0; n < 10000; n++) {
+		char expect[record_len + 1];
+		char rec[record_len + 1];
+		unsigned int i;
+
+		seed = seed * 1103515245 + 12345;
+		i = (seed >> 8) % count;
+		make_record(expect, i);
+
+		if (!in.seekg((std::streamoff)i * record_len) ||
+		    !in.read(rec, record_len) ||
+		    std::memcmp(rec, expect, record_len)) {
+			std::fprintf(stderr, "record %u: seek mismatch\n", i);
+			return -1;
+		}
+	}
+
+	std::printf("Random reads:       10000 in %.3f s\n", elapsed(start));
+
+	/* Rewrite some records in place, and check them */
+	std::iostream io(&fb);
+
+	for (unsigned int i = 0; i < count; i += 97) {
+		char rec[record_len + 1];
+
+		std::snprintf(rec, sizeof(rec), "%-31u\n", i);
+		io.seekp((std::streamoff)i * record_len);
+		io.write(rec, record_len);
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		char expect[record_len + 1];
+		char rec[record_len + 1];
+
+		if (i % 97)
+			make_record(expect, i);
+		else
+			std::snprintf(expect, sizeof(expect), "%-31u\n", i);
+
+		if (!io.seekg((std::streamoff)i * record_len) ||
+		    !io.read(rec, record_len) ||
+		    std::memcmp(rec, expect, record_len)) {
+			std::fprintf(stderr, "record %u: rewrite mismatch\n",
+				     i);
+			return -1;
+		}
+	}
+
+	if (fb.get()->file_size != count * record_len) {
+		std::fprintf(stderr, "stream.dat: size changed\n");
+		return -1;
+	}
+
+	return fb.close();
+}
+
+int main(int argc, char **argv)
+{
+	const unsigned int num_files = argc > 1 ? std::atoi(argv[1]) : 500;
+	const unsigned int passes = argc > 2 ? std::atoi(argv[2]) : 100;
+	mem_device dev;
+	ufatpp::volume v;
+	ufatpp::directory dir;
+	std::vector<naive_entry> naive;
+	unsigned long entries = 0;
+	unsigned long bytes = 0;
+	unsigned long allocs;
+	int err;
+
+	dev.base.log2_block_size = 9;
+	dev.base.read = mem_read;
+	dev.base.write = mem_write;
+	dev.data.resize(65536u << 9);
+
+	err = ufat_mkfs(&dev.base, 65536);
+	if (err >= 0)
+		err = v.open(dev.base);
+	if (err < 0) {
+		std::fprintf(stderr, "open: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	if (populate(v, dir, num_files) < 0)
+		return -1;
+
+	/* Directory listing through ufat.hpp */
+	allocs = num_allocs;
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned int p = 0; p < passes; p++) {
+		auto range = dir.entries();
+
+		for (const auto &e : range) {
+			entries++;
+			bytes += e.name.size();
+		}
+
+		if (range.error() < 0) {
+			std::fprintf(stderr, "list: %s\n",
+				     ufat_strerror(range.error()));
+			return -1;
+		}
+	}
+
+	const double t_view = elapsed(start);
+	const unsigned long view_allocs = num_allocs - allocs;
+
+	/* Open and read every file into a stack buffer */
+	allocs = num_allocs;
+
+	for (const auto &e : dir.entries()) {
+		std::array<char, 128> buf;
+		ufatpp::file f;
+
+		if (e.is_directory())
+			continue;
+
+		err = f.open(v, e.info);
+		if (err >= 0)
+			err = f.read(buf);
+		if (err < 0) {
+			std::fprintf(stderr, "%.*s: %s\n",
+				     (int)e.name.size(), e.name.data(),
+				     ufat_strerror(err));
+			return -1;
+		}
+	}
+
+	const unsigned long read_allocs = num_allocs - allocs;
+
+	/* The same listing, copying names into std::string */
+	allocs = num_allocs;
+	start = std::chrono::steady_clock::now();
+
+	for (unsigned int p = 0; p < passes; p++)
+		if (naive_list(dir.get(), naive) < 0)
+			return -1;
+
+	const double t_naive = elapsed(start);
+	const unsigned long naive_allocs = num_allocs - allocs;
+
+	std::printf("Entries per pass:   %lu\n", entries / passes);
+	std::printf("Passes:             %u\n", passes);
+	std::printf("Name bytes:         %lu\n", bytes);
+	std::printf("\n");
+	std::printf("ufat.hpp:           %lu allocations, %.3f s\n",
+		    view_allocs, t_view);
+	std::printf("std::string copies: %lu allocations, %.3f s\n",
+		    naive_allocs, t_naive);
+	std::printf("Allocations/entry:  %.2f vs %.2f\n",
+		    (double)view_allocs / entries,
+		    (double)naive_allocs / entries);
+	std::printf("File reads:         %lu allocations\n", read_allocs);
+	std::printf("\n");
+
+	if (stream_bench(v, dir, 40000) < 0)
+		return -1;
+
+	return (view_allocs || read_allocs) ? 1 : 0;
+}
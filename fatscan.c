@@ -0,0 +1,348 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "fatscan.h"
+
+/* Number of ranges per worker. Having more ranges than workers evens
+ * out the load when some ranges are slower to read than others.
+ */
+#define RANGES_PER_THREAD	4
+
+/* Ranges are aligned to this many clusters, so that FAT12 entry pairs and
+ * free-map bytes are never split between workers.
+ */
+#define RANGE_ALIGN		8
+
+struct range {
+	ufat_cluster_t		start;
+	ufat_cluster_t		end;
+
+	struct fatscan_result	res;
+
+	/* Length of free runs touching the start and end of the range */
+	ufat_cluster_t		head_free;
+	ufat_cluster_t		tail_free;
+	int			err;
+};
+
+struct scan {
+	int			fd;
+	const struct ufat_bpb	*bpb;
+	off_t			fat_offset;
+	uint8_t			*free_map;
+
+	pthread_mutex_t		lock;
+	unsigned int		next_range;
+	unsigned int		num_ranges;
+	struct range		*ranges;
+};
+
+static off_t entry_offset(ufat_fat_type_t type, ufat_cluster_t c)
+{
+	switch (type) {
+	case UFAT_TYPE_FAT12: return ((off_t)c * 3) >> 1;
+	case UFAT_TYPE_FAT16: return (off_t)c << 1;
+	case UFAT_TYPE_FAT32: return (off_t)c << 2;
+	}
+
+	return 0;
+}
+
+static int read_fully(int fd, void *buf, size_t len, off_t offset)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		ssize_t r = pread(fd, p, len, offset);
+
+		if (r < 0) {
+			perror("fatscan: pread");
+			return -1;
+		}
+
+		/* Past the end of the image */
+		if (!r) {
+			memset(p, 0, len);
+			break;
+		}
+
+		p += r;
+		len -= r;
+		offset += r;
+	}
+
+	return 0;
+}
+
+/* Decode an entry. Returns 0 for free, 1 for used and 2 for bad. */
+static int classify(ufat_fat_type_t type, const uint8_t *base,
+		    off_t base_offset, ufat_cluster_t c)
+{
+	const uint8_t *p = base + (entry_offset(type, c) - base_offset);
+	uint32_t v;
+
+	switch (type) {
+	case UFAT_TYPE_FAT12:
+		v = p[0] | (p[1] << 8);
+		v = (c & 1) ? (v >> 4) : (v & 0xfff);
+		return v ? (v == 0xff7 ? 2 : 1) : 0;
+
+	case UFAT_TYPE_FAT16:
+		v = p[0] | (p[1] << 8);
+		return v ? (v == 0xfff7 ? 2 : 1) : 0;
+
+	case UFAT_TYPE_FAT32:
+		v = (p[0] | (p[1] << 8) | (p[2] << 16) |
+		     ((uint32_t)p[3] << 24)) & 0x0fffffff;
+		return v ? (v == 0xffffff7 ? 2 : 1) : 0;
+	}
+
+	return 1;
+}
+
+static void scan_range(struct scan *s, struct range *r)
+{
+	const ufat_fat_type_t type = s->bpb->type;
+	const off_t first = entry_offset(type, r->start);
+	const off_t last = entry_offset(type, r->end) + 4;
+	uint8_t *buf = malloc(last - first);
+	ufat_cluster_t run = 0;
+	int at_head = 1;
+	ufat_cluster_t c;
+
+	memset(&r->res, 0, sizeof(r->res));
+	r->head_free = 0;
+	r->tail_free = 0;
+
+	if (!buf) {
+		perror("fatscan: malloc");
+		r->err = -1;
+		return;
+	}
+
+	if (read_fully(s->fd, buf, last - first, s->fat_offset + first) < 0) {
+		free(buf);
+		r->err = -1;
+		return;
+	}
+
+	for (c = r->start; c < r->end; c++) {
+		int k;
+
+		/* Never used in a FAT12 system */
+		if (c == 0xff0 && type == UFAT_TYPE_FAT12)
+			k = 1;
+		else
+			k = classify(type, buf, first, c);
+
+		if (!k) {
+			r->res.free_clusters++;
+			run++;
+
+			if (s->free_map)
+				s->free_map[c >> 3] |= 1 << (c & 7);
+
+			continue;
+		}
+
+		if (k == 2)
+			r->res.bad_clusters++;
+		else
+			r->res.used_clusters++;
+
+		if (at_head) {
+			r->head_free = run;
+			at_head = 0;
+		} else if (run) {
+			r->res.free_runs++;
+		}
+
+		if (run > r->res.largest_free_run)
+			r->res.largest_free_run = run;
+
+		run = 0;
+	}
+
+	if (at_head) {
+		/* The whole range is free */
+		r->head_free = run;
+	} else if (run > r->res.largest_free_run) {
+		r->res.largest_free_run = run;
+	}
+
+	r->tail_free = run;
+	r->err = 0;
+	free(buf);
+}
+
+static void *worker(void *arg)
+{
+	struct scan *s = arg;
+
+	for (;;) {
+		unsigned int i;
+
+		pthread_mutex_lock(&s->lock);
+		i = s->next_range++;
+		pthread_mutex_unlock(&s->lock);
+
+		if (i >= s->num_ranges)
+			break;
+
+		scan_range(s, &s->ranges[i]);
+	}
+
+	return NULL;
+}
+
+/* Merge per-range results in cluster order. Free runs which cross range
+ * boundaries are joined up here.
+ */
+static int merge(const struct scan *s, struct fatscan_result *out)
+{
+	ufat_cluster_t run = 0;
+	unsigned int i;
+
+	memset(out, 0, sizeof(*out));
+
+	for (i = 0; i < s->num_ranges; i++) {
+		const struct range *r = &s->ranges[i];
+		const int all_free = r->res.free_clusters == r->end - r->start;
+
+		if (r->err < 0)
+			return -1;
+
+		out->free_clusters += r->res.free_clusters;
+		out->used_clusters += r->res.used_clusters;
+		out->bad_clusters += r->res.bad_clusters;
+		out->free_runs += r->res.free_runs;
+
+		if (r->res.largest_free_run > out->largest_free_run)
+			out->largest_free_run = r->res.largest_free_run;
+
+		run += r->head_free;
+
+		if (!all_free) {
+			if (run) {
+				out->free_runs++;
+				if (run > out->largest_free_run)
+					out->largest_free_run = run;
+			}
+
+			run = r->tail_free;
+		}
+	}
+
+	if (run) {
+		out->free_runs++;
+		if (run > out->largest_free_run)
+			out->largest_free_run = run;
+	}
+
+	return 0;
+}
+
+int fatscan_run(int fd, const struct ufat_bpb *bpb,
+		unsigned int log2_block_size, unsigned int threads,
+		uint8_t *free_map, struct fatscan_result *r)
+{
+	const ufat_cluster_t total = bpb->num_clusters - 2;
+	ufat_cluster_t per_range;
+	pthread_t *tids;
+	struct scan s;
+	unsigned int i;
+	int ret;
+
+	if (!threads) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = n > 0 ? n : 1;
+	}
+
+	s.fd = fd;
+	s.bpb = bpb;
+	s.fat_offset = (off_t)bpb->fat_start << log2_block_size;
+	s.free_map = free_map;
+	s.next_range = 0;
+
+	/* Divide the cluster range into aligned pieces */
+	per_range = total / (threads * RANGES_PER_THREAD) + 1;
+	per_range = (per_range + RANGE_ALIGN - 1) & ~(RANGE_ALIGN - 1);
+	s.num_ranges = (bpb->num_clusters + per_range - 1) / per_range;
+
+	s.ranges = calloc(s.num_ranges, sizeof(s.ranges[0]));
+	tids = calloc(threads, sizeof(tids[0]));
+	if (!s.ranges || !tids) {
+		perror("fatscan: calloc");
+		free(s.ranges);
+		free(tids);
+		return -1;
+	}
+
+	for (i = 0; i < s.num_ranges; i++) {
+		s.ranges[i].start = i * per_range + (i ? 0 : 2);
+		s.ranges[i].end = (i + 1) * per_range;
+		if (s.ranges[i].end > bpb->num_clusters)
+			s.ranges[i].end = bpb->num_clusters;
+	}
+
+	pthread_mutex_init(&s.lock, NULL);
+
+	if (threads > s.num_ranges)
+		threads = s.num_ranges;
+
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tids[i], NULL, worker, &s)) {
+			fprintf(stderr, "fatscan: failed to create thread\n");
+			break;
+		}
+
+	/* If no threads could be started, do the work here */
+	if (!i)
+		worker(&s);
+
+	while (i)
+		pthread_join(tids[--i], NULL);
+
+	pthread_mutex_destroy(&s.lock);
+
+	ret = merge(&s, r);
+	free(s.ranges);
+	free(tids);
+	return ret;
+}
@@ -0,0 +1,73 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FATSCAN_H_
+#define FATSCAN_H_
+
+/* Parallel FAT scanner for host builds.
+ *
+ * This reads the FAT directly from an image file descriptor, bypassing the
+ * uFAT cache. The FAT is split into ranges which are read with large
+ * pread() calls and decoded by a pool of worker threads. Per-range results
+ * are merged when all workers have finished.
+ *
+ * Any modifications made through a struct ufat must be synced to the
+ * image before scanning.
+ */
+
+#include "ufat.h"
+
+struct fatscan_result {
+	ufat_cluster_t		free_clusters;
+	ufat_cluster_t		used_clusters;
+	ufat_cluster_t		bad_clusters;
+
+	/* Runs of contiguous free clusters */
+	ufat_cluster_t		free_runs;
+	ufat_cluster_t		largest_free_run;
+};
+
+/* Scan the first FAT of the image open on the given file descriptor. If
+ * threads is 0, one thread is used per online CPU.
+ *
+ * If free_map is not NULL, it should point to a zeroed buffer of at least
+ * (num_clusters + 7) / 8 bytes. Bit n (LSB-first) is set for each free
+ * cluster n.
+ *
+ * Returns 0 on success or -1 if an error occurs.
+ */
+int fatscan_run(int fd, const struct ufat_bpb *bpb,
+		unsigned int log2_block_size, unsigned int threads,
+		uint8_t *free_map, struct fatscan_result *r);
+
+#endif
@@ -0,0 +1,354 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fscheck.h"
+
+#define PATH_MAX_LEN		1024
+
+#define SEEN_CHAIN		1
+#define SEEN_START		2
+
+struct check {
+	struct ufat		*uf;
+	FILE			*out;
+	struct fscheck_result	*r;
+
+	/* Decoded copy of the first FAT, and a flag for each cluster which
+	 * has been reached from the directory tree (SEEN_START if it's the
+	 * first of a chain).
+	 */
+	ufat_cluster_t		*fat;
+	uint8_t			*seen;
+	ufat_size_t		cluster_size;
+};
+
+static void problem(struct check *c, int is_error, const char *path,
+		    const char *fmt, ...)
+{
+	va_list ap;
+
+	if (is_error)
+		c->r->errors++;
+	else
+		c->r->warnings++;
+
+	if (!c->out)
+		return;
+
+	fprintf(c->out, "%s: %s: ", is_error ? "error" : "warning",
+		path[0] ? path : "/");
+	va_start(ap, fmt);
+	vfprintf(c->out, fmt, ap);
+	va_end(ap);
+	fputc('\n', c->out);
+}
+
+static ufat_cluster_t decode_entry(ufat_fat_type_t type, const uint8_t *fat,
+				   ufat_cluster_t index)
+{
+	uint32_t v;
+
+	switch (type) {
+	case UFAT_TYPE_FAT12:
+		v = fat[index + (index >> 1)] |
+			(fat[index + (index >> 1) + 1] << 8);
+		v = (index & 1) ? v >> 4 : v & 0xfff;
+		if (v >= 0xff8)
+			return UFAT_CLUSTER_EOC;
+		if (v == 0xff7)
+			return UFAT_CLUSTER_BAD;
+		return v;
+
+	case UFAT_TYPE_FAT16:
+		v = fat[index << 1] | (fat[(index << 1) + 1] << 8);
+		if (v >= 0xfff8)
+			return UFAT_CLUSTER_EOC;
+		if (v == 0xfff7)
+			return UFAT_CLUSTER_BAD;
+		return v;
+
+	case UFAT_TYPE_FAT32:
+		v = ((uint32_t)fat[index << 2] |
+		     ((uint32_t)fat[(index << 2) + 1] << 8) |
+		     ((uint32_t)fat[(index << 2) + 2] << 16) |
+		     ((uint32_t)fat[(index << 2) + 3] << 24)) & 0x0fffffff;
+		if (v >= 0x0ffffff8)
+			return UFAT_CLUSTER_EOC;
+		if (v == 0x0ffffff7)
+			return UFAT_CLUSTER_BAD;
+		return v;
+	}
+
+	return UFAT_CLUSTER_BAD;
+}
+
+/* Read and decode the first FAT, and compare the others with it */
+static int load_fat(struct check *c)
+{
+	struct ufat *uf = c->uf;
+	const struct ufat_bpb *bpb = &uf->bpb;
+	const size_t len = bpb->fat_size << uf->dev->log2_block_size;
+	uint8_t *first = malloc(len);
+	uint8_t *copy = malloc(len);
+	ufat_cluster_t i;
+	int ret = -1;
+
+	if (!first || !copy) {
+		perror("fscheck: malloc");
+		goto out;
+	}
+
+	if (uf->dev->read(uf->dev, bpb->fat_start, bpb->fat_size, first) < 0) {
+		fprintf(stderr, "fscheck: can't read FAT\n");
+		goto out;
+	}
+
+	for (i = 1; i < bpb->fat_count; i++) {
+		if (uf->dev->read(uf->dev, bpb->fat_start + i * bpb->fat_size,
+				  bpb->fat_size, copy) < 0) {
+			fprintf(stderr, "fscheck: can't read FAT copy %u\n", i);
+			goto out;
+		}
+
+		if (memcmp(first, copy, len))
+			problem(c, 0, "", "FAT copy %u differs from the first",
+				i);
+	}
+
+	for (i = 0; i < bpb->num_clusters; i++)
+		c->fat[i] = decode_entry(bpb->type, first, i);
+
+	ret = 0;
+out:
+	free(first);
+	free(copy);
+	return ret;
+}
+
+/* Follow a chain, marking each cluster as seen. Returns the number of
+ * clusters in the chain, or -1 if it's broken and can't be trusted.
+ */
+static long check_chain(struct check *c, const char *path,
+			ufat_cluster_t first)
+{
+	const ufat_cluster_t num_clusters = c->uf->bpb.num_clusters;
+	ufat_cluster_t cl = first;
+	long n = 0;
+
+	if (cl == UFAT_CLUSTER_FREE)
+		return 0;
+
+	/* Two entries for the same chain are left by an interrupted move */
+	if (cl < num_clusters && c->seen[cl] == SEEN_START) {
+		problem(c, 0, path, "shares its clusters with another entry");
+		return -1;
+	}
+
+	while (cl != UFAT_CLUSTER_EOC) {
+		if (!UFAT_CLUSTER_IS_PTR(cl) || cl >= num_clusters) {
+			problem(c, 1, path, "invalid cluster %u in chain", cl);
+			return -1;
+		}
+
+		if (c->seen[cl]) {
+			problem(c, 1, path, "cross-linked at cluster %u", cl);
+			return -1;
+		}
+
+		if (c->fat[cl] == UFAT_CLUSTER_FREE) {
+			problem(c, 1, path, "chain reaches free cluster %u",
+				cl);
+			return -1;
+		}
+
+		c->seen[cl] = (cl == first) ? SEEN_START : SEEN_CHAIN;
+		c->r->used_clusters++;
+		n++;
+		cl = c->fat[cl];
+	}
+
+	return n;
+}
+
+static int check_dir(struct check *c, struct ufat_directory *dir,
+		     char *path, size_t path_len);
+
+static int check_entry(struct check *c, const struct ufat_dirent *ent,
+		       char *path, size_t path_len)
+{
+	const long n = check_chain(c, path, ent->first_cluster);
+	struct ufat_directory sub;
+	int err;
+
+	if (!(ent->attributes & UFAT_ATTR_DIRECTORY)) {
+		const ufat_size_t need =
+			(ent->file_size + c->cluster_size - 1) /
+			c->cluster_size;
+
+		c->r->files++;
+		if (n < 0)
+			return 0;
+
+		if ((ufat_size_t)n < need)
+			problem(c, 1, path,
+				"size %lu needs %lu clusters, chain has %ld",
+				(unsigned long)ent->file_size,
+				(unsigned long)need, n);
+		else if ((ufat_size_t)n > need)
+			problem(c, 0, path,
+				"chain of %ld clusters exceeds size %lu", n,
+				(unsigned long)ent->file_size);
+
+		return 0;
+	}
+
+	c->r->dirs++;
+	if (n <= 0) {
+		if (!n)
+			problem(c, 1, path, "directory has no clusters");
+		return 0;
+	}
+
+	err = ufat_open_subdir(c->uf, &sub, ent);
+	if (err < 0) {
+		problem(c, 1, path, "can't open directory: %s",
+			ufat_strerror(err));
+		return 0;
+	}
+
+	return check_dir(c, &sub, path, path_len);
+}
+
+static int check_dir(struct check *c, struct ufat_directory *dir,
+		     char *path, size_t path_len)
+{
+	for (;;) {
+		struct ufat_dirent ent;
+		char name[UFAT_LFN_MAX_UTF8];
+		int err;
+
+		err = ufat_dir_read(dir, &ent, name, sizeof(name));
+		if (err < 0) {
+			path[path_len] = 0;
+			problem(c, 1, path, "can't read directory: %s",
+				ufat_strerror(err));
+			return 0;
+		}
+
+		if (err)
+			break;
+
+		if (ent.short_name[0] == '.' ||
+		    (ent.attributes & UFAT_ATTR_VOLLABEL))
+			continue;
+
+		if (path_len + strlen(name) + 2 > PATH_MAX_LEN) {
+			fprintf(stderr, "fscheck: path too long\n");
+			return -1;
+		}
+
+		path[path_len] = '/';
+		strcpy(path + path_len + 1, name);
+
+		if (check_entry(c, &ent, path,
+				path_len + strlen(name) + 1) < 0)
+			return -1;
+	}
+
+	path[path_len] = 0;
+	return 0;
+}
+
+int fscheck_run(struct ufat *uf, FILE *out, struct fscheck_result *r)
+{
+	const struct ufat_bpb *bpb = &uf->bpb;
+	struct ufat_directory root;
+	struct check c;
+	char path[PATH_MAX_LEN];
+	ufat_cluster_t i;
+	int err;
+	int ret = -1;
+
+	memset(r, 0, sizeof(*r));
+	c.uf = uf;
+	c.out = out;
+	c.r = r;
+	c.cluster_size = (ufat_size_t)1 << (bpb->log2_blocks_per_cluster +
+					    uf->dev->log2_block_size);
+	c.fat = malloc(bpb->num_clusters * sizeof(c.fat[0]));
+	c.seen = calloc(bpb->num_clusters, 1);
+
+	if (!c.fat || !c.seen) {
+		perror("fscheck: malloc");
+		goto out;
+	}
+
+	/* The FAT is read from the device, so it must be up to date */
+	err = ufat_sync(uf);
+	if (err < 0) {
+		fprintf(stderr, "fscheck: ufat_sync: %s\n",
+			ufat_strerror(err));
+		goto out;
+	}
+
+	if (load_fat(&c) < 0)
+		goto out;
+
+	path[0] = 0;
+	if (bpb->type == UFAT_TYPE_FAT32 &&
+	    check_chain(&c, path, bpb->root_cluster) <= 0) {
+		problem(&c, 1, path, "root directory chain is broken");
+	} else {
+		ufat_open_root(uf, &root);
+		if (check_dir(&c, &root, path, 0) < 0)
+			goto out;
+	}
+
+	for (i = 2; i < bpb->num_clusters; i++)
+		if (!c.seen[i] && c.fat[i] != UFAT_CLUSTER_FREE &&
+		    c.fat[i] != UFAT_CLUSTER_BAD)
+			r->lost_clusters++;
+
+	if (r->lost_clusters)
+		problem(&c, 0, "", "%lu clusters are allocated but unused",
+			(unsigned long)r->lost_clusters);
+
+	ret = 0;
+out:
+	free(c.fat);
+	free(c.seen);
+	return ret;
+}
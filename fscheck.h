@@ -0,0 +1,74 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FSCHECK_H_
+#define FSCHECK_H_
+
+/* Filesystem consistency checker for host builds.
+ *
+ * The directory tree is walked through the given struct ufat, and the
+ * cluster chain of every entry is checked against a copy of the FAT read
+ * directly from the device. Problems are classed as:
+ *
+ *   - errors: damage which loses or corrupts data, such as chains which
+ *     are cross-linked, loop, run into free clusters or are too short for
+ *     the file size.
+ *   - warnings: space which is allocated but unreachable, chains longer
+ *     than their file size, and FAT copies which differ. These are left
+ *     behind by an interrupted update which was correctly ordered.
+ *
+ * The filesystem is synced before the FAT is read.
+ */
+
+#include <stdio.h>
+#include "ufat.h"
+
+struct fscheck_result {
+	unsigned int		errors;
+	unsigned int		warnings;
+
+	unsigned int		files;
+	unsigned int		dirs;
+	ufat_cluster_t		used_clusters;
+	ufat_cluster_t		lost_clusters;
+};
+
+/* Check the filesystem. Each problem found is described on the given
+ * stream, if it's not NULL.
+ *
+ * Returns 0 if the check ran (whether or not problems were found), or -1
+ * if it couldn't be completed.
+ */
+int fscheck_run(struct ufat *uf, FILE *out, struct fscheck_result *r);
+
+#endif
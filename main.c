@@ -39,22 +39,41 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "ufat.h"
+#include "fatscan.h"
+#include "treewalk.h"
+#include "fscheck.h"
+#include "powerfail.h"
 
 struct command;
 
 #define OPTION_STATISTICS	0x01
 #define OPTION_RANDOMIZE	0x02
 #define OPTION_MKFS		0x04
+#define OPTION_FREE_SUMMARY	0x08
+#define OPTION_PREFETCH		0x10
+#define OPTION_MAP		0x20
 
 struct options {
 	int			flags;
 	unsigned int		log2_bs;
 	unsigned int		seed;
+	unsigned int		log2_line;
+	unsigned int		sync_step;
+	unsigned int		io_step;
+	unsigned int		wbq_blocks;
+	ufat_block_t		log_start;
+	unsigned int		log_count;
 	ufat_block_t		num_blocks;
 
 	const char		*in_file;
 	const char		*out_file;
+	const char		*cache_save;
+	const char		*cache_load;
 
 	const char		*filename;
 	const struct command	*command;
@@ -72,28 +91,34 @@ struct file_device {
 	struct ufat_device	base;
 	FILE			*f;
 	int			is_read_only;
+
+	/* Read-only mapping of the image, if --map was given */
+	const uint8_t		*mapped;
+	size_t			mapped_len;
 };
 
+/* The device is accessed with pread()/pwrite(), so that it can be shared
+ * by several threads (see treewalk.c).
+ */
 static int file_device_read(const struct ufat_device *dev, ufat_block_t start,
 			    ufat_block_t count, void *buffer)
 {
 	struct file_device *f = (struct file_device *)dev;
+	const size_t len = count << f->base.log2_block_size;
+	ssize_t r;
 
-	if (fseek(f->f, start << f->base.log2_block_size, SEEK_SET) < 0) {
-		perror("file_device_read: fseek");
+	r = pread(fileno(f->f), buffer, len,
+		  start << f->base.log2_block_size);
+	if (r < 0) {
+		perror("file_device_read: pread");
 		return -1;
 	}
 
-	if (fread(buffer, 1 << f->base.log2_block_size,
-		  count, f->f) != count) {
-		if (feof(f->f)) {
-			memset(buffer, 0xcc,
-			       (1 << f->base.log2_block_size) * count);
-		} else {
-			perror("file_device_read: fread");
-			return -1;
-		}
-	}
+	/* A read that runs off the end of the image is short. Keep what was
+	 * read, and fill only the missing tail.
+	 */
+	if ((size_t)r != len)
+		memset((char *)buffer + r, 0xcc, len - r);
 
 	return 0;
 }
@@ -102,23 +127,54 @@ static int file_device_write(const struct ufat_device *dev, ufat_block_t start,
 			     ufat_block_t count, const void *buffer)
 {
 	struct file_device *f = (struct file_device *)dev;
+	const size_t len = count << f->base.log2_block_size;
 
 	if (f->is_read_only) {
 		fprintf(stderr, "file_device_write: read-only device\n");
 		return -1;
 	}
 
-	if (fseek(f->f, start << f->base.log2_block_size, SEEK_SET) < 0) {
-		perror("file_device_write: fseek");
+	if (pwrite(fileno(f->f), buffer, len,
+		   start << f->base.log2_block_size) != (ssize_t)len) {
+		perror("file_device_write: pwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+static const void *file_device_map(const struct ufat_device *dev,
+				   ufat_block_t start, ufat_block_t count)
+{
+	const struct file_device *f = (const struct file_device *)dev;
+
+	if ((start + count) << f->base.log2_block_size > f->mapped_len)
+		return NULL;
+
+	return f->mapped + (start << f->base.log2_block_size);
+}
+
+/* Map the image as it stands, to simulate execute-in-place flash. Writes
+ * through pwrite() remain visible in the mapping.
+ */
+static int file_device_mmap(struct file_device *dev)
+{
+	struct stat st;
+	void *m;
+
+	if (fstat(fileno(dev->f), &st) < 0) {
+		perror("fstat");
 		return -1;
 	}
 
-	if (fwrite(buffer, 1 << f->base.log2_block_size,
-		   count, f->f) != count) {
-		perror("file_device_write: fwrite");
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(dev->f), 0);
+	if (m == MAP_FAILED) {
+		perror("mmap");
 		return -1;
 	}
 
+	dev->mapped = m;
+	dev->mapped_len = st.st_size;
 	return 0;
 }
 
@@ -129,6 +185,8 @@ static int file_device_open(struct file_device *dev, const char *fname,
 	dev->base.read = file_device_read;
 	dev->base.write = file_device_write;
 	dev->is_read_only = 0;
+	dev->mapped = NULL;
+	dev->mapped_len = 0;
 
 	if (create) {
 		dev->f = fopen(fname, "wb+");
@@ -150,6 +208,9 @@ static int file_device_open(struct file_device *dev, const char *fname,
 
 static void file_device_close(struct file_device *dev)
 {
+	if (dev->mapped)
+		munmap((void *)dev->mapped, dev->mapped_len);
+
 	fclose(dev->f);
 }
 
@@ -385,6 +446,37 @@ static int cmd_fstat(struct ufat *uf, const struct options *opt)
 	return close_output(opt->out_file, out);
 }
 
+/* File IO goes through the resumable interface if --io-step was given */
+static int file_read(struct ufat_file *f, void *buf, ufat_size_t len,
+		     const struct options *opt)
+{
+	int r;
+
+	if (!opt->io_step)
+		return ufat_file_read(f, buf, len);
+
+	ufat_file_read_begin(f, buf, len);
+	while ((r = ufat_file_step(f, opt->io_step)) > 0)
+		;
+
+	return r < 0 ? r : (int)f->op_done;
+}
+
+static int file_write(struct ufat_file *f, const void *buf, ufat_size_t len,
+		      const struct options *opt)
+{
+	int r;
+
+	if (!opt->io_step)
+		return ufat_file_write(f, buf, len);
+
+	ufat_file_write_begin(f, buf, len);
+	while ((r = ufat_file_step(f, opt->io_step)) > 0)
+		;
+
+	return r < 0 ? r : (int)f->op_done;
+}
+
 static int cmd_read(struct ufat *uf, const struct options *opt)
 {
 	FILE *out;
@@ -412,13 +504,23 @@ static int cmd_read(struct ufat *uf, const struct options *opt)
 
 	for (;;) {
 		char buf[16384];
+		const void *data = buf;
 		int req_size = sizeof(buf);
-		int len;
+		int len = -UFAT_ERR_NOT_MAPPED;
 
 		if (opt->flags & OPTION_RANDOMIZE)
 			req_size = random() % sizeof(buf) + 1;
 
-		len = ufat_file_read(&file, buf, req_size);
+		/* Mapped data is written out in whole extents */
+		if (opt->flags & OPTION_MAP)
+			len = ufat_file_map(&file, &data,
+					    (opt->flags & OPTION_RANDOMIZE) ?
+					    (ufat_size_t)req_size :
+					    ent.file_size);
+
+		if (len == -UFAT_ERR_NOT_MAPPED)
+			len = file_read(&file, buf, req_size, opt);
+
 		if (len < 0) {
 			fprintf(stderr, "ufat_file_read: %s\n",
 				ufat_strerror(len));
@@ -429,7 +531,7 @@ static int cmd_read(struct ufat *uf, const struct options *opt)
 		if (!len)
 			break;
 
-		if (fwrite(buf, 1, len, out) != (size_t)len) {
+		if (fwrite(data, 1, len, out) != (size_t)len) {
 			perror("fwrite");
 			close_output(opt->out_file, out);
 			return -1;
@@ -510,7 +612,7 @@ static int cmd_write(struct ufat *uf, const struct options *opt)
 		if (!len)
 			break;
 
-		len = ufat_file_write(&file, buf, len);
+		len = file_write(&file, buf, len, opt);
 		if (len < 0) {
 			fprintf(stderr, "ufat_file_write: %s\n",
 				ufat_strerror(len));
@@ -553,6 +655,28 @@ static int cmd_rm(struct ufat *uf, const struct options *opt)
 	return 0;
 }
 
+static int cmd_rmtree(struct ufat *uf, const struct options *opt)
+{
+	struct ufat_dirent ent;
+	int err;
+
+	if (!opt->argc) {
+		fprintf(stderr, "You must specify a file path\n");
+		return -1;
+	}
+
+	if (require_file(uf, opt->argv[0], &ent) < 0)
+		return -1;
+
+	err = ufat_remove_tree(uf, &ent);
+	if (err < 0) {
+		fprintf(stderr, "ufat_remove_tree: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
 static int cmd_mkdir(struct ufat *uf, const struct options *opt)
 {
 	const char *basename;
@@ -596,6 +720,40 @@ static int cmd_mkdir(struct ufat *uf, const struct options *opt)
 	return 0;
 }
 
+static int cmd_mkdirs(struct ufat *uf, const struct options *opt)
+{
+	struct ufat_directory dir;
+	struct ufat_dirent ent;
+	struct tm *local;
+	time_t now = time(NULL);
+	int err;
+
+	if (!opt->argc) {
+		fprintf(stderr, "You must specify a file path\n");
+		return -1;
+	}
+
+	local = localtime(&now);
+	ent.attributes = 0;
+	ent.create_date = UFAT_DATE(local->tm_year + 1900, local->tm_mon + 1,
+				    local->tm_mday);
+	ent.create_time = UFAT_TIME(local->tm_hour, local->tm_min,
+				    local->tm_sec);
+	ent.modify_date = ent.create_date;
+	ent.modify_time = ent.create_time;
+	ent.access_date = ent.create_date;
+
+	ufat_open_root(uf, &dir);
+	err = ufat_dir_create_path(&dir, &ent, opt->argv[0]);
+	if (err < 0) {
+		fprintf(stderr, "ufat_dir_create_path: %s\n",
+			ufat_strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
 static int parse_dosattr(const char *attr, ufat_attr_t *a)
 {
 	ufat_attr_t out = 0;
@@ -907,6 +1065,374 @@ static int cmd_chattr(struct ufat *uf, const struct options *opt)
 	return 0;
 }
 
+static int cmd_free(struct ufat *uf, const struct options *opt)
+{
+	const unsigned int cluster_size =
+		1 << (uf->bpb.log2_blocks_per_cluster +
+		      uf->dev->log2_block_size);
+	ufat_cluster_t free_clusters;
+	FILE *out;
+	int err;
+
+	err = ufat_count_free_clusters(uf, &free_clusters);
+	if (err < 0) {
+		fprintf(stderr, "ufat_count_free_clusters: %s\n",
+			ufat_strerror(err));
+		return -1;
+	}
+
+	out = open_output(opt->out_file);
+	if (!out)
+		return -1;
+
+	fprintf(out, "Free clusters: %u of %u\n",
+		free_clusters, uf->bpb.num_clusters - 2);
+	fprintf(out, "Free bytes:    %llu\n",
+		(unsigned long long)free_clusters * cluster_size);
+
+	return close_output(opt->out_file, out);
+}
+
+static int cmd_du(struct ufat *uf, const struct options *opt)
+{
+	const unsigned int cluster_size =
+		1 << (uf->bpb.log2_blocks_per_cluster +
+		      uf->dev->log2_block_size);
+	struct ufat_dirent ent;
+	struct ufat_usage u;
+	FILE *out;
+	int err;
+
+	if (opt->argc && require_file(uf, opt->argv[0], &ent) < 0)
+		return -1;
+
+	err = ufat_tree_usage(uf, opt->argc ? &ent : NULL, &u);
+	if (err < 0) {
+		fprintf(stderr, "ufat_tree_usage: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	out = open_output(opt->out_file);
+	if (!out)
+		return -1;
+
+	fprintf(out, "Directories:    %u\n", u.directories);
+	fprintf(out, "Files:          %u\n", u.files);
+	fprintf(out, "Logical bytes:  %llu\n", u.logical_bytes);
+	fprintf(out, "File clusters:  %u\n", u.file_clusters);
+	fprintf(out, "Dir clusters:   %u\n", u.dir_clusters);
+	fprintf(out, "Physical bytes: %llu\n",
+		((unsigned long long)u.file_clusters + u.dir_clusters) *
+		cluster_size);
+
+	return close_output(opt->out_file, out);
+}
+
+static int cmd_fatscan(struct ufat *uf, const struct options *opt)
+{
+	const struct file_device *dev = (const struct file_device *)uf->dev;
+	struct fatscan_result r;
+	unsigned int threads = 0;
+	FILE *out;
+	int err;
+
+	if (opt->argc)
+		threads = atoi(opt->argv[0]);
+
+	/* Make sure the image is up to date before reading it directly */
+	err = ufat_sync(uf);
+	if (err < 0) {
+		fprintf(stderr, "ufat_sync: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	fflush(dev->f);
+
+	if (fatscan_run(fileno(dev->f), &uf->bpb, uf->dev->log2_block_size,
+			threads, NULL, &r) < 0)
+		return -1;
+
+	out = open_output(opt->out_file);
+	if (!out)
+		return -1;
+
+	fprintf(out, "Free clusters:    %u\n", r.free_clusters);
+	fprintf(out, "Used clusters:    %u\n", r.used_clusters);
+	fprintf(out, "Bad clusters:     %u\n", r.bad_clusters);
+	fprintf(out, "Free runs:        %u\n", r.free_runs);
+	fprintf(out, "Largest free run: %u\n", r.largest_free_run);
+
+	return close_output(opt->out_file, out);
+}
+
+struct walk_totals {
+	pthread_mutex_t		lock;
+	unsigned long long	dirs;
+	unsigned long long	files;
+	unsigned long long	bytes;
+};
+
+static int walk_visit(void *ctx, const struct ufat_dirent *ent,
+		      const char *path)
+{
+	struct walk_totals *t = ctx;
+
+	(void)path;
+
+	pthread_mutex_lock(&t->lock);
+	if (ent->attributes & UFAT_ATTR_DIRECTORY) {
+		t->dirs++;
+	} else {
+		t->files++;
+		t->bytes += ent->file_size;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return 0;
+}
+
+static int cmd_walk(struct ufat *uf, const struct options *opt)
+{
+	struct walk_totals t;
+	unsigned int threads = 0;
+	FILE *out;
+	int err;
+
+	if (opt->argc)
+		threads = atoi(opt->argv[0]);
+
+	/* Workers mount the device independently */
+	err = ufat_sync(uf);
+	if (err < 0) {
+		fprintf(stderr, "ufat_sync: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	memset(&t, 0, sizeof(t));
+	pthread_mutex_init(&t.lock, NULL);
+	err = treewalk_run(uf->dev, NULL, threads, walk_visit, &t);
+	pthread_mutex_destroy(&t.lock);
+
+	if (err < 0)
+		return -1;
+
+	out = open_output(opt->out_file);
+	if (!out)
+		return -1;
+
+	fprintf(out, "Directories: %llu\n", t.dirs);
+	fprintf(out, "Files:       %llu\n", t.files);
+	fprintf(out, "Bytes:       %llu\n", t.bytes);
+
+	return close_output(opt->out_file, out);
+}
+
+static int cmd_check(struct ufat *uf, const struct options *opt)
+{
+	struct fscheck_result r;
+	FILE *out;
+
+	out = open_output(opt->out_file);
+	if (!out)
+		return -1;
+
+	if (fscheck_run(uf, out, &r) < 0) {
+		close_output(opt->out_file, out);
+		return -1;
+	}
+
+	fprintf(out, "Directories:   %u\n", r.dirs);
+	fprintf(out, "Files:         %u\n", r.files);
+	fprintf(out, "Used clusters: %lu\n", (unsigned long)r.used_clusters);
+	fprintf(out, "Lost clusters: %lu\n", (unsigned long)r.lost_clusters);
+	fprintf(out, "Errors:        %u\n", r.errors);
+	fprintf(out, "Warnings:      %u\n", r.warnings);
+
+	if (close_output(opt->out_file, out) < 0)
+		return -1;
+
+	return r.errors ? -1 : 0;
+}
+
+/* Power-fail test. The workload is run on a copy of the image, with the
+ * same cache, write-back and log options as the command line asks for.
+ */
+#define CRASH_FILES		8
+
+struct crash_ctx {
+	const struct options	*opt;
+	uint8_t			*log_buf;
+	struct ufat_wbq		wbq;
+	struct ufat_wbq_entry	*wbq_ent;
+	uint8_t			*wbq_data;
+};
+
+static int crash_setup(void *ctx, struct ufat *uf)
+{
+	struct crash_ctx *c = (struct crash_ctx *)ctx;
+	const struct options *opt = c->opt;
+	int err;
+
+	if (opt->log_count) {
+		err = ufat_log_attach(uf, opt->log_start, opt->log_count,
+				      c->log_buf);
+		if (err < 0)
+			return err;
+	}
+
+	err = ufat_set_cache_line(uf, opt->log2_line > opt->log2_bs ?
+				  opt->log2_line - opt->log2_bs : 0);
+	if (err < 0)
+		return err;
+
+	if (opt->wbq_blocks) {
+		ufat_wbq_init(&c->wbq, opt->log2_bs, c->wbq_ent, c->wbq_data,
+			      opt->wbq_blocks);
+		ufat_set_dispatch(uf, &c->wbq.base);
+	}
+
+	return 0;
+}
+
+/* Create a directory of files of various sizes, then delete, truncate,
+ * extend or move each of them.
+ */
+static int crash_workload(void *ctx, struct ufat *uf)
+{
+	static char data[CRASH_FILES * 1500];
+	struct ufat_directory root;
+	struct ufat_directory dir;
+	struct ufat_dirent ent;
+	struct ufat_file f;
+	char name[64];
+	int i;
+	int err;
+
+	(void)ctx;
+
+	ufat_open_root(uf, &root);
+	memset(&ent, 0, sizeof(ent));
+	err = ufat_dir_create(&root, &ent, "crashtest");
+	if (err < 0)
+		return err;
+
+	err = ufat_open_subdir(uf, &dir, &ent);
+	if (err < 0)
+		return err;
+
+	for (i = 0; i < CRASH_FILES; i++) {
+		snprintf(name, sizeof(name), "crash test file %d", i);
+		memset(&ent, 0, sizeof(ent));
+
+		err = ufat_dir_mkfile(&dir, &ent, name);
+		if (err < 0)
+			return err;
+
+		err = ufat_open_file(uf, &f, &ent);
+		if (err < 0)
+			return err;
+
+		err = ufat_file_write(&f, data, 1000 + i * 1400);
+		if (err < 0)
+			return err;
+	}
+
+	for (i = 0; i < CRASH_FILES; i++) {
+		snprintf(name, sizeof(name), "crash test file %d", i);
+
+		err = ufat_dir_find(&dir, name, &ent);
+		if (err < 0)
+			return err;
+		if (err)
+			continue;
+
+		switch (i & 3) {
+		case 0:
+			err = ufat_dir_delete(uf, &ent);
+			break;
+
+		case 1:
+			err = ufat_open_file(uf, &f, &ent);
+			if (err >= 0)
+				err = ufat_file_read(&f, data, 700);
+			if (err >= 0)
+				err = ufat_file_truncate(&f);
+			break;
+
+		case 2:
+			err = ufat_open_file(uf, &f, &ent);
+			if (err >= 0)
+				err = ufat_file_read(&f, data, sizeof(data));
+			if (err >= 0)
+				err = ufat_file_write(&f, data, 3000);
+			break;
+
+		case 3:
+			err = ufat_move(&ent, &root, name);
+			break;
+		}
+
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static int cmd_crashtest(struct ufat *uf, const struct options *opt)
+{
+	static const struct powerfail_ops ops = {
+		crash_setup, crash_workload
+	};
+	const ufat_block_t num_blocks = uf->bpb.cluster_start +
+		((ufat_block_t)(uf->bpb.num_clusters - 2) <<
+		 uf->bpb.log2_blocks_per_cluster);
+	struct powerfail_result r;
+	struct crash_ctx c;
+	FILE *out;
+	int err;
+
+	err = ufat_sync(uf);
+	if (err < 0) {
+		fprintf(stderr, "ufat_sync: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	c.opt = opt;
+	c.log_buf = malloc(1 << opt->log2_bs);
+	c.wbq_ent = malloc((opt->wbq_blocks + 1) * sizeof(c.wbq_ent[0]));
+	c.wbq_data = malloc((opt->wbq_blocks + 1) << opt->log2_bs);
+
+	out = open_output(opt->out_file);
+	if (!c.log_buf || !c.wbq_ent || !c.wbq_data || !out) {
+		if (out)
+			close_output(opt->out_file, out);
+		else
+			perror("malloc");
+		err = -1;
+		goto out;
+	}
+
+	err = powerfail_run(uf->dev, num_blocks,
+			    opt->argc && !strcmp(opt->argv[0], "tear"),
+			    &ops, &c, out, &r);
+	if (!err) {
+		fprintf(out, "Writes:        %u\n", r.writes);
+		fprintf(out, "Cuts tested:   %u\n", r.runs);
+		fprintf(out, "Failed:        %u\n", r.failed);
+		fprintf(out, "With warnings: %u\n", r.warned);
+	}
+
+	if (close_output(opt->out_file, out) < 0 || r.failed)
+		err = -1;
+
+out:
+	free(c.log_buf);
+	free(c.wbq_ent);
+	free(c.wbq_data);
+	return err;
+}
+
 static void show_info(FILE *out, const struct ufat_bpb *bpb)
 {
 	fprintf(out, "Type:                       FAT%d\n", bpb->type);
@@ -929,12 +1455,26 @@ static void usage(const char *progname)
 "\n"
 "Options may be any of the following:\n"
 "  -b block-size           Set the simulated block size\n"
+"  -L line-size            Set the cache line size, in bytes\n"
 "  -S                      Show performance statistics\n"
 "  -R seed                 Randomize file IO request sizes\n"
 "  -i filename             Read input from the given file\n"
 "  -o filename             Write output to the given file\n"
 "  --mkfs <num blocks>     Initialize the filesystem (WARNING: all existing\n"
 "                          data will be lost)\n"
+"  --free-summary          Build a free-space summary after opening\n"
+"  --prefetch              Read FAT and root directory blocks after opening\n"
+"  --cache-load <file>     Warm the cache from a saved block list\n"
+"  --cache-save <file>     Save the cached block list before closing\n"
+"  --sync-step <blocks>    Flush the cache in steps of at most this many\n"
+"                          blocks before closing\n"
+"  --io-step <requests>    Read and write files in steps of about this many\n"
+"                          device requests\n"
+"  --wbq <blocks>          Defer cache write-back using a queue of the given\n"
+"                          size\n"
+"  --log <start:count>     Use an intent log in the given reserved blocks\n"
+"  --map                   Map the image into memory, and read file data\n"
+"                          from the mapping\n"
 "  --help                  Show this text\n"
 "  --version               Show version information\n"
 "\n"
@@ -944,11 +1484,21 @@ static void usage(const char *progname)
 "  read [file]             Dump the contents of the given file\n"
 "  write [file]            Write to a file\n"
 "  rm [path]               Remove a directory or file\n"
+"  rmtree [path]           Remove a directory and everything in it\n"
 "  mkdir [directory]       Create a new empty directory\n"
+"  mkdirs [directory]      Create a directory and any missing parents\n"
 "  chattr [path] [attributes]\n"
 "                          Alter file attributes/dates/times (see below)\n"
 "  move [src] [dst]        Move a file from one place to another\n"
 "  rename [src] [new-name] Rename a file without moving it\n"
+"  free                    Show the amount of free space\n"
+"  du [path]               Show the space used by a file or directory tree\n"
+"  fatscan [threads]       Scan the FAT in parallel and show usage\n"
+"  walk [threads]          Walk the directory tree in parallel and show\n"
+"                          totals\n"
+"  check                   Check the filesystem for consistency\n"
+"  crashtest [tear]        Cut power after each write of a test workload,\n"
+"                          and check each result (the image isn't changed)\n"
 "\n"
 "Attributes are specified using arguments with a key=value syntax:\n"
 "  create_date=YYYY-MM-DD  Creation date\n"
@@ -1002,10 +1552,18 @@ static const struct command command_table[] = {
 	{"read",	cmd_read},
 	{"write",	cmd_write},
 	{"rm",		cmd_rm},
+	{"rmtree",	cmd_rmtree},
 	{"mkdir",	cmd_mkdir},
+	{"mkdirs",	cmd_mkdirs},
 	{"chattr",	cmd_chattr},
 	{"move",	cmd_move},
-	{"rename",	cmd_rename}
+	{"rename",	cmd_rename},
+	{"free",	cmd_free},
+	{"du",		cmd_du},
+	{"fatscan",	cmd_fatscan},
+	{"walk",	cmd_walk},
+	{"check",	cmd_check},
+	{"crashtest",	cmd_crashtest}
 };
 
 static const struct command *find_command(const char *name)
@@ -1023,12 +1581,92 @@ static const struct command *find_command(const char *name)
 	return NULL;
 }
 
+static int sync_in_steps(struct ufat *uf, unsigned int max_blocks)
+{
+	int r;
+
+	while ((r = ufat_sync_step(uf, max_blocks)) > 0)
+		;
+
+	if (r < 0) {
+		fprintf(stderr, "ufat_sync_step: %s\n", ufat_strerror(r));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int cache_save(const struct ufat *uf, const char *fname)
+{
+	ufat_block_t list[UFAT_CACHE_MAX_BLOCKS];
+	const unsigned int count =
+		ufat_cache_export(uf, list, UFAT_CACHE_MAX_BLOCKS);
+	unsigned int i;
+	FILE *f;
+
+	f = fopen(fname, "w");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s for writing: %s\n",
+			fname, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < count; i++)
+		fprintf(f, "%llu\n", (unsigned long long)list[i]);
+
+	if (fclose(f) < 0) {
+		fprintf(stderr, "Error on closing %s: %s\n",
+			fname, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int cache_load(struct ufat *uf, const char *fname)
+{
+	ufat_block_t list[UFAT_CACHE_MAX_BLOCKS];
+	unsigned long long b;
+	unsigned int count = 0;
+	FILE *f;
+	int err;
+
+	f = fopen(fname, "r");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s for reading: %s\n",
+			fname, strerror(errno));
+		return -1;
+	}
+
+	while (count < UFAT_CACHE_MAX_BLOCKS && fscanf(f, "%llu", &b) == 1)
+		list[count++] = b;
+
+	fclose(f);
+
+	err = ufat_cache_warm(uf, list, count);
+	if (err < 0) {
+		fprintf(stderr, "ufat_cache_warm: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
 static int parse_options(int argc, char **argv, struct options *opt)
 {
 	static const struct option longopts[] = {
 		{"help",	0, 0, 'H'},
 		{"version",	0, 0, 'V'},
 		{"mkfs",	1, 0, 'M'},
+		{"free-summary", 0, 0, 'F'},
+		{"prefetch",	0, 0, 'P'},
+		{"cache-save",	1, 0, 'C'},
+		{"cache-load",	1, 0, 'c'},
+		{"sync-step",	1, 0, 'Y'},
+		{"io-step",	1, 0, 'I'},
+		{"wbq",		1, 0, 'Q'},
+		{"log",		1, 0, 'J'},
+		{"map",		0, 0, 'X'},
 		{NULL, 0, 0, 0}
 	};
 	int o;
@@ -1036,7 +1674,7 @@ static int parse_options(int argc, char **argv, struct options *opt)
 	memset(opt, 0, sizeof(*opt));
 	opt->log2_bs = 9;
 
-	while ((o = getopt_long(argc, argv, "b:SR:i:o:", longopts, NULL)) >= 0)
+	while ((o = getopt_long(argc, argv, "b:L:SR:i:o:", longopts, NULL)) >= 0)
 		switch (o) {
 		case 'i':
 			opt->in_file = optarg;
@@ -1051,6 +1689,62 @@ static int parse_options(int argc, char **argv, struct options *opt)
 			opt->num_blocks = atoll(optarg);
 			break;
 
+		case 'F':
+			opt->flags |= OPTION_FREE_SUMMARY;
+			break;
+
+		case 'L':
+			if (parse_blocksize(optarg, &opt->log2_line) < 0)
+				return -1;
+			break;
+
+		case 'P':
+			opt->flags |= OPTION_PREFETCH;
+			break;
+
+		case 'X':
+			opt->flags |= OPTION_MAP;
+			break;
+
+		case 'C':
+			opt->cache_save = optarg;
+			break;
+
+		case 'c':
+			opt->cache_load = optarg;
+			break;
+
+		case 'I':
+			opt->io_step = atoi(optarg);
+			if (!opt->io_step) {
+				fprintf(stderr, "IO step must be greater "
+					"than 0\n");
+				return -1;
+			}
+			break;
+
+		case 'Q':
+			opt->wbq_blocks = atoi(optarg);
+			break;
+
+		case 'J':
+			if (sscanf(optarg, "%llu:%u", &opt->log_start,
+				   &opt->log_count) != 2) {
+				fprintf(stderr, "Log area must be given as "
+					"start:count\n");
+				return -1;
+			}
+			break;
+
+		case 'Y':
+			opt->sync_step = atoi(optarg);
+			if (!opt->sync_step) {
+				fprintf(stderr, "Sync step must be greater "
+					"than 0\n");
+				return -1;
+			}
+			break;
+
 		case 'R':
 			opt->flags |= OPTION_RANDOMIZE;
 			opt->seed = atoi(optarg);
@@ -1133,6 +1827,11 @@ int main(int argc, char **argv)
 	struct file_device dev;
 	struct ufat uf;
 	struct options opt;
+	uint16_t *summary = NULL;
+	struct ufat_wbq wbq;
+	struct ufat_wbq_entry *wbq_ent = NULL;
+	uint8_t *wbq_data = NULL;
+	uint8_t *log_buf = NULL;
 	int err;
 
 	if (parse_options(argc, argv, &opt) < 0)
@@ -1153,6 +1852,11 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if ((opt.flags & OPTION_MAP) && file_device_mmap(&dev) < 0) {
+		file_device_close(&dev);
+		return -1;
+	}
+
 	err = ufat_open(&uf, &dev.base);
 	if (err) {
 		fprintf(stderr, "ufat_open: %s\n", ufat_strerror(err));
@@ -1160,6 +1864,81 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	if (opt.flags & OPTION_MAP)
+		ufat_set_map(&uf, file_device_map);
+
+	if (opt.log_count) {
+		log_buf = malloc(1 << opt.log2_bs);
+		if (!log_buf) {
+			perror("malloc");
+			err = -1;
+			goto out;
+		}
+
+		err = ufat_log_attach(&uf, opt.log_start, opt.log_count,
+				      log_buf);
+		if (err < 0) {
+			fprintf(stderr, "ufat_log_attach: %s\n",
+				ufat_strerror(err));
+			err = -1;
+			goto out;
+		}
+	}
+
+	err = ufat_set_cache_line(&uf, opt.log2_line > opt.log2_bs ?
+				  opt.log2_line - opt.log2_bs : 0);
+	if (err < 0) {
+		fprintf(stderr, "ufat_set_cache_line: %s\n", ufat_strerror(err));
+		err = -1;
+		goto out;
+	}
+
+	if (opt.cache_load && cache_load(&uf, opt.cache_load) < 0) {
+		err = -1;
+		goto out;
+	}
+
+	if (opt.flags & OPTION_PREFETCH) {
+		err = ufat_prefetch_metadata(&uf);
+		if (err < 0) {
+			fprintf(stderr, "ufat_prefetch_metadata: %s\n",
+				ufat_strerror(err));
+			err = -1;
+			goto out;
+		}
+	}
+
+	if (opt.flags & OPTION_FREE_SUMMARY) {
+		summary = malloc(uf.bpb.fat_size * sizeof(summary[0]));
+		if (!summary) {
+			perror("malloc");
+			err = -1;
+			goto out;
+		}
+
+		err = ufat_free_summary_init(&uf, summary, uf.bpb.fat_size);
+		if (err < 0) {
+			fprintf(stderr, "ufat_free_summary_init: %s\n",
+				ufat_strerror(err));
+			err = -1;
+			goto out;
+		}
+	}
+
+	if (opt.wbq_blocks) {
+		wbq_ent = malloc(opt.wbq_blocks * sizeof(wbq_ent[0]));
+		wbq_data = malloc(opt.wbq_blocks << opt.log2_bs);
+		if (!wbq_ent || !wbq_data) {
+			perror("malloc");
+			err = -1;
+			goto out;
+		}
+
+		ufat_wbq_init(&wbq, opt.log2_bs, wbq_ent, wbq_data,
+			      opt.wbq_blocks);
+		ufat_set_dispatch(&uf, &wbq.base);
+	}
+
 	if (!opt.command) {
 		FILE *out = open_output(opt.out_file);
 
@@ -1173,8 +1952,19 @@ int main(int argc, char **argv)
 		err = opt.command->func(&uf, &opt);
 	}
 
+	if (opt.cache_save && cache_save(&uf, opt.cache_save) < 0)
+		err = -1;
+
+	if (opt.sync_step && sync_in_steps(&uf, opt.sync_step) < 0)
+		err = -1;
+
+out:
 	ufat_close(&uf);
 	file_device_close(&dev);
+	free(summary);
+	free(wbq_ent);
+	free(wbq_data);
+	free(log_buf);
 
 	if (opt.flags & OPTION_STATISTICS)
 		dump_stats(&uf.stat);
@@ -0,0 +1,651 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host-side image builder.
+ *
+ * This builds a read-only asset image from a directory tree or a manifest,
+ * laid out for fast reading:
+ *
+ *   - directory entries are sorted by name;
+ *   - every directory is contiguous, and all of them are placed together
+ *     just after the FAT;
+ *   - every file is one contiguous extent, and files follow each other in
+ *     read order (manifest order, or a sorted depth-first walk).
+ *
+ * The image is built in memory and written out in one sequential pass.
+ *
+ * A manifest has one entry per line. Each is either an image path and a
+ * host file, separated by a tab, or an image path ending in '/', for an
+ * empty directory. If there's no tab, the image path is also the host path.
+ * Blank lines and lines beginning with '#' are ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ufat.h"
+
+struct node {
+	char			*name;
+	char			*path;
+	char			*src;
+	int			is_dir;
+	time_t			mtime;
+	struct ufat_dirent	ent;
+
+	struct node		*parent;
+	struct node		*children;
+	struct node		*next;
+
+	/* Files in read order, and directories in creation order */
+	struct node		*next_file;
+	struct node		*next_dir;
+};
+
+struct builder {
+	struct node		root;
+	struct node		*files;
+	struct node		**files_tail;
+
+	unsigned int		num_dirs;
+	unsigned int		num_files;
+	unsigned long long	num_bytes;
+};
+
+struct mem_device {
+	struct ufat_device	base;
+	uint8_t			*data;
+	ufat_block_t		num_blocks;
+};
+
+static int mem_read(const struct ufat_device *dev, ufat_block_t start,
+		    ufat_block_t count, void *buffer)
+{
+	const struct mem_device *m = (const struct mem_device *)dev;
+
+	if (start + count > m->num_blocks)
+		return -1;
+
+	memcpy(buffer, m->data + (start << dev->log2_block_size),
+	       count << dev->log2_block_size);
+	return 0;
+}
+
+static int mem_write(const struct ufat_device *dev, ufat_block_t start,
+		     ufat_block_t count, const void *buffer)
+{
+	const struct mem_device *m = (const struct mem_device *)dev;
+
+	if (start + count > m->num_blocks)
+		return -1;
+
+	memcpy(m->data + (start << dev->log2_block_size), buffer,
+	       count << dev->log2_block_size);
+	return 0;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+	char *p = malloc(strlen(dir) + strlen(name) + 2);
+
+	if (!p) {
+		perror("malloc");
+		return NULL;
+	}
+
+	sprintf(p, "%s/%s", dir, name);
+	return p;
+}
+
+/* Add a node to a directory, keeping its children sorted by name. If a
+ * node of that name already exists, it's returned instead.
+ */
+static struct node *add_node(struct builder *b, struct node *parent,
+			     const char *name, int len, int is_dir)
+{
+	struct node **p = &parent->children;
+	struct node *n;
+
+	while (*p) {
+		const int cmp = strncmp((*p)->name, name, len);
+
+		if (!cmp && !(*p)->name[len]) {
+			if ((*p)->is_dir != is_dir) {
+				fprintf(stderr, "%s: both a file and a "
+					"directory\n", (*p)->path);
+				return NULL;
+			}
+
+			return *p;
+		}
+
+		if (cmp > 0 || (!cmp && (*p)->name[len]))
+			break;
+
+		p = &(*p)->next;
+	}
+
+	n = calloc(1, sizeof(*n));
+	if (!n) {
+		perror("calloc");
+		return NULL;
+	}
+
+	n->name = malloc(len + 1);
+	if (!n->name) {
+		perror("malloc");
+		free(n);
+		return NULL;
+	}
+
+	memcpy(n->name, name, len);
+	n->name[len] = 0;
+
+	n->path = join_path(parent->path, n->name);
+	if (!n->path) {
+		free(n->name);
+		free(n);
+		return NULL;
+	}
+
+	n->is_dir = is_dir;
+	n->mtime = time(NULL);
+	n->parent = parent;
+	n->next = *p;
+	*p = n;
+
+	if (is_dir)
+		b->num_dirs++;
+
+	return n;
+}
+
+/* Append a file to the read order */
+static void add_file(struct builder *b, struct node *n)
+{
+	b->num_files++;
+	*b->files_tail = n;
+	b->files_tail = &n->next_file;
+}
+
+static void free_node(struct node *n)
+{
+	while (n->children) {
+		struct node *c = n->children;
+
+		n->children = c->next;
+		free_node(c);
+		free(c);
+	}
+
+	free(n->name);
+	free(n->path);
+	free(n->src);
+}
+
+/* Read a host directory tree. Files are added in sorted depth-first
+ * order, which is then their read order.
+ */
+static int scan_tree(struct builder *b, struct node *parent, const char *src)
+{
+	DIR *d = opendir(src);
+	struct dirent *de;
+	struct node *c;
+
+	if (!d) {
+		perror(src);
+		return -1;
+	}
+
+	while ((de = readdir(d))) {
+		struct stat st;
+		char *p;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		p = join_path(src, de->d_name);
+		if (!p)
+			goto fail;
+
+		if (stat(p, &st) < 0) {
+			perror(p);
+			free(p);
+			goto fail;
+		}
+
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+			free(p);
+			continue;
+		}
+
+		c = add_node(b, parent, de->d_name, strlen(de->d_name),
+			     S_ISDIR(st.st_mode));
+		if (!c) {
+			free(p);
+			goto fail;
+		}
+
+		c->mtime = st.st_mtime;
+		c->src = p;
+	}
+
+	closedir(d);
+
+	/* Recurse only once this level is sorted, so that files are added
+	 * in depth-first order.
+	 */
+	for (c = parent->children; c; c = c->next) {
+		if (!c->is_dir)
+			add_file(b, c);
+		else if (scan_tree(b, c, c->src) < 0)
+			return -1;
+	}
+
+	return 0;
+
+fail:
+	closedir(d);
+	return -1;
+}
+
+static int read_manifest(struct builder *b, const char *fname)
+{
+	FILE *in = fopen(fname, "r");
+	char line[4096];
+	int lineno = 0;
+
+	if (!in) {
+		perror(fname);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), in)) {
+		struct node *n = &b->root;
+		char *path = line;
+		char *src;
+		struct stat st;
+
+		lineno++;
+		line[strcspn(line, "\r\n")] = 0;
+		if (!line[0] || line[0] == '#')
+			continue;
+
+		src = strchr(line, '\t');
+		if (src)
+			*(src++) = 0;
+		else
+			src = line;
+
+		/* Create each component of the path in turn */
+		while (*path) {
+			const int len = strcspn(path, "/");
+			const int is_dir = path[len] == '/';
+
+			if (len)
+				n = add_node(b, n, path, len, is_dir);
+			if (!n) {
+				fclose(in);
+				return -1;
+			}
+
+			path += len + is_dir;
+		}
+
+		if (n->is_dir)
+			continue;
+
+		if (n->src) {
+			fprintf(stderr, "%s:%d: duplicate entry: %s\n",
+				fname, lineno, n->path);
+			fclose(in);
+			return -1;
+		}
+
+		if (stat(src, &st) < 0) {
+			perror(src);
+			fclose(in);
+			return -1;
+		}
+
+		n->mtime = st.st_mtime;
+		n->src = strdup(src);
+		if (!n->src) {
+			perror("strdup");
+			fclose(in);
+			return -1;
+		}
+
+		add_file(b, n);
+	}
+
+	fclose(in);
+	return 0;
+}
+
+static void set_times(struct ufat_dirent *ent, time_t t)
+{
+	const struct tm *tm = localtime(&t);
+	const int year = tm->tm_year + 1900;
+
+	memset(ent, 0, sizeof(*ent));
+	if (year < 1980)
+		return;
+
+	ent->create_date = UFAT_DATE(year, tm->tm_mon + 1, tm->tm_mday);
+	ent->create_time = UFAT_TIME(tm->tm_hour, tm->tm_min, tm->tm_sec);
+	ent->modify_date = ent->create_date;
+	ent->modify_time = ent->create_time;
+	ent->access_date = ent->create_date;
+}
+
+/* Create entries for all of a directory's children. Subdirectories get an
+ * empty file as a placeholder, so that the directory reaches its full size
+ * before anything else is allocated.
+ */
+static int fill_dir(struct ufat_directory *dir, struct node *n)
+{
+	struct node *c;
+
+	for (c = n->children; c; c = c->next) {
+		int err;
+
+		set_times(&c->ent, c->mtime);
+		err = ufat_dir_mkfile(dir, &c->ent, c->name);
+		if (err < 0) {
+			fprintf(stderr, "%s: %s\n", c->path,
+				ufat_strerror(err));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int open_dir(struct ufat *uf, struct ufat_directory *dir,
+		    const struct node *n)
+{
+	int err;
+
+	if (!n->parent) {
+		ufat_open_root(uf, dir);
+		return 0;
+	}
+
+	err = ufat_open_subdir(uf, dir, &n->ent);
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", n->path, ufat_strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Create directories breadth-first. Each replaces its placeholder and is
+ * filled straight away, so the allocator places it in one extent directly
+ * after the last.
+ */
+static int build_dirs(struct builder *b, struct ufat *uf)
+{
+	struct node *queue = &b->root;
+	struct node **tail = &b->root.next_dir;
+
+	for (; queue; queue = queue->next_dir) {
+		struct ufat_directory parent;
+		struct ufat_directory dir;
+		struct node *c;
+
+		if (queue->parent) {
+			int err;
+
+			if (open_dir(uf, &parent, queue->parent) < 0)
+				return -1;
+
+			err = ufat_dir_delete(uf, &queue->ent);
+			if (err >= 0)
+				err = ufat_dir_create(&parent, &queue->ent,
+						      queue->name);
+			if (err < 0) {
+				fprintf(stderr, "%s: %s\n", queue->path,
+					ufat_strerror(err));
+				return -1;
+			}
+		}
+
+		if (open_dir(uf, &dir, queue) < 0 || fill_dir(&dir, queue) < 0)
+			return -1;
+
+		for (c = queue->children; c; c = c->next)
+			if (c->is_dir) {
+				*tail = c;
+				tail = &c->next_dir;
+			}
+	}
+
+	return 0;
+}
+
+static int copy_file(struct builder *b, struct ufat *uf, struct node *n)
+{
+	static char buf[65536];
+	struct ufat_file f;
+	FILE *in;
+	int err;
+
+	in = fopen(n->src, "rb");
+	if (!in) {
+		perror(n->src);
+		return -1;
+	}
+
+	err = ufat_open_file(uf, &f, &n->ent);
+	while (err >= 0) {
+		const size_t len = fread(buf, 1, sizeof(buf), in);
+
+		if (!len)
+			break;
+
+		err = ufat_file_write(&f, buf, len);
+		b->num_bytes += len;
+	}
+
+	if (ferror(in)) {
+		perror(n->src);
+		fclose(in);
+		return -1;
+	}
+
+	fclose(in);
+
+	if (err < 0) {
+		fprintf(stderr, "%s: %s\n", n->path, ufat_strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int build(struct builder *b, struct mem_device *m)
+{
+	struct ufat uf;
+	struct node *n;
+	int err;
+
+	err = ufat_mkfs(&m->base, m->num_blocks);
+	if (err < 0) {
+		fprintf(stderr, "ufat_mkfs: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	err = ufat_open(&uf, &m->base);
+	if (err < 0) {
+		fprintf(stderr, "ufat_open: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	if (build_dirs(b, &uf) < 0) {
+		ufat_close(&uf);
+		return -1;
+	}
+
+	for (n = b->files; n; n = n->next_file)
+		if (copy_file(b, &uf, n) < 0) {
+			ufat_close(&uf);
+			return -1;
+		}
+
+	err = ufat_sync(&uf);
+	ufat_close(&uf);
+
+	if (err < 0) {
+		fprintf(stderr, "ufat_sync: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int write_image(const struct mem_device *m, const char *fname)
+{
+	FILE *out = fopen(fname, "wb");
+	const size_t len = m->num_blocks << m->base.log2_block_size;
+
+	if (!out) {
+		perror(fname);
+		return -1;
+	}
+
+	if (fwrite(m->data, 1, len, out) != len) {
+		perror(fname);
+		fclose(out);
+		return -1;
+	}
+
+	if (fclose(out) < 0) {
+		perror(fname);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void usage(const char *progname)
+{
+	printf(
+"Usage: %s [-b block-size] <image file> <num blocks> <source>\n"
+"\n"
+"Build a FAT image containing the given directory tree or manifest. Any\n"
+"existing image file is overwritten.\n",
+progname);
+}
+
+int main(int argc, char **argv)
+{
+	struct builder b;
+	struct mem_device m;
+	struct stat st;
+	unsigned int log2_bs = 9;
+	int ret = -1;
+	int o;
+
+	while ((o = getopt(argc, argv, "b:h")) >= 0)
+		switch (o) {
+		case 'b':
+			for (log2_bs = 9; log2_bs < 16; log2_bs++)
+				if (atoi(optarg) == 1 << log2_bs)
+					break;
+
+			if (log2_bs >= 16) {
+				fprintf(stderr, "Invalid block size: %s\n",
+					optarg);
+				return -1;
+			}
+			break;
+
+		case 'h':
+			usage(argv[0]);
+			return 0;
+
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+
+	if (argc - optind != 3) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.root.is_dir = 1;
+	b.root.path = strdup("");
+	b.files_tail = &b.files;
+
+	m.base.log2_block_size = log2_bs;
+	m.base.read = mem_read;
+	m.base.write = mem_write;
+	m.num_blocks = strtoull(argv[optind + 1], NULL, 0);
+	m.data = calloc(m.num_blocks, 1 << log2_bs);
+
+	if (!b.root.path || !m.data) {
+		perror("malloc");
+		goto out;
+	}
+
+	if (stat(argv[optind + 2], &st) < 0) {
+		perror(argv[optind + 2]);
+		goto out;
+	}
+
+	if (S_ISDIR(st.st_mode) ? scan_tree(&b, &b.root, argv[optind + 2]) :
+	    read_manifest(&b, argv[optind + 2]))
+		goto out;
+
+	if (build(&b, &m) < 0 || write_image(&m, argv[optind]) < 0)
+		goto out;
+
+	printf("Directories: %u\n", b.num_dirs);
+	printf("Files:       %u\n", b.num_files);
+	printf("Bytes:       %llu\n", b.num_bytes);
+	ret = 0;
+
+out:
+	free_node(&b.root);
+	free(m.data);
+	return ret;
+}
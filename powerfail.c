@@ -0,0 +1,285 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "powerfail.h"
+#include "fscheck.h"
+
+static int pf_read(const struct ufat_device *dev, ufat_block_t start,
+		   ufat_block_t count, void *buffer)
+{
+	const struct powerfail_device *pf =
+		(const struct powerfail_device *)dev;
+
+	if (pf->requests > pf->cut)
+		return -1;
+
+	return pf->dev->read(pf->dev, start, count, buffer);
+}
+
+static int pf_write(const struct ufat_device *dev, ufat_block_t start,
+		    ufat_block_t count, const void *buffer)
+{
+	struct powerfail_device *pf = (struct powerfail_device *)dev;
+	const unsigned int n = pf->requests;
+
+	if (pf->sizes && n < pf->max_sizes)
+		pf->sizes[n] = count;
+
+	pf->requests++;
+	pf->blocks += count;
+
+	if (n < pf->cut)
+		return pf->dev->write(pf->dev, start, count, buffer);
+
+	if (n == pf->cut && pf->tear)
+		pf->dev->write(pf->dev, start,
+			       pf->tear < count ? pf->tear : count, buffer);
+
+	return -1;
+}
+
+void powerfail_init(struct powerfail_device *pf,
+		    const struct ufat_device *dev)
+{
+	pf->base.log2_block_size = dev->log2_block_size;
+	pf->base.read = pf_read;
+	pf->base.write = pf_write;
+	pf->dev = dev;
+
+	pf->requests = 0;
+	pf->blocks = 0;
+	pf->cut = POWERFAIL_NEVER;
+	pf->tear = 0;
+
+	pf->sizes = NULL;
+	pf->max_sizes = 0;
+}
+
+/* In-memory image, restored from a saved copy before each run */
+struct mem_device {
+	struct ufat_device	base;
+	uint8_t			*data;
+	ufat_block_t		num_blocks;
+};
+
+static int mem_read(const struct ufat_device *dev, ufat_block_t start,
+		    ufat_block_t count, void *buffer)
+{
+	const struct mem_device *m = (const struct mem_device *)dev;
+
+	if (start + count > m->num_blocks)
+		return -1;
+
+	memcpy(buffer, m->data + (start << dev->log2_block_size),
+	       count << dev->log2_block_size);
+	return 0;
+}
+
+static int mem_write(const struct ufat_device *dev, ufat_block_t start,
+		     ufat_block_t count, const void *buffer)
+{
+	const struct mem_device *m = (const struct mem_device *)dev;
+
+	if (start + count > m->num_blocks)
+		return -1;
+
+	memcpy(m->data + (start << dev->log2_block_size), buffer,
+	       count << dev->log2_block_size);
+	return 0;
+}
+
+/* Run the workload once, with power cut at the given point */
+static int run_once(struct mem_device *m, const uint8_t *image,
+		    struct powerfail_device *pf,
+		    const struct powerfail_ops *ops, void *ctx)
+{
+	struct ufat uf;
+	int err;
+
+	memcpy(m->data, image, m->num_blocks << m->base.log2_block_size);
+
+	err = ufat_open(&uf, &pf->base);
+	if (err < 0)
+		return err;
+
+	err = ops->setup(ctx, &uf);
+	if (err >= 0)
+		err = ops->workload(ctx, &uf);
+
+	ufat_close(&uf);
+	return err;
+}
+
+/* Remount the image left by a run, and check it. Returns the number of
+ * errors found, or -1 if the filesystem couldn't be mounted.
+ */
+static int check_once(struct mem_device *m, const struct powerfail_ops *ops,
+		      void *ctx, FILE *out, struct fscheck_result *res)
+{
+	struct ufat uf;
+	int err;
+
+	err = ufat_open(&uf, &m->base);
+	if (err < 0) {
+		if (out)
+			fprintf(out, "  ufat_open: %s\n", ufat_strerror(err));
+		return -1;
+	}
+
+	err = ops->setup(ctx, &uf);
+	if (err < 0) {
+		if (out)
+			fprintf(out, "  setup: %s\n", ufat_strerror(err));
+		ufat_close(&uf);
+		return -1;
+	}
+
+	err = fscheck_run(&uf, out, res);
+	ufat_close(&uf);
+
+	if (err < 0)
+		return -1;
+
+	return res->errors;
+}
+
+static void check_cut(struct mem_device *m, const uint8_t *image,
+		     unsigned int cut, ufat_block_t tear,
+		     const struct powerfail_ops *ops, void *ctx,
+		     FILE *out, struct powerfail_result *r)
+{
+	struct powerfail_device pf;
+	struct fscheck_result res;
+
+	powerfail_init(&pf, &m->base);
+	pf.cut = cut;
+	pf.tear = tear;
+
+	/* Errors after the cut are expected, and don't matter */
+	run_once(m, image, &pf, ops, ctx);
+	r->runs++;
+
+	if (!check_once(m, ops, ctx, NULL, &res)) {
+		if (res.warnings)
+			r->warned++;
+		return;
+	}
+
+	r->failed++;
+	if (!out)
+		return;
+
+	fprintf(out, "Cut after %u writes", cut);
+	if (tear)
+		fprintf(out, " (%lu blocks of the next)",
+			(unsigned long)tear);
+	fprintf(out, ":\n");
+
+	/* Check again to describe the problems. The image has already been
+	 * remounted once, so any log replay is complete.
+	 */
+	check_once(m, ops, ctx, out, &res);
+}
+
+int powerfail_run(const struct ufat_device *dev, ufat_block_t num_blocks,
+		  int tear, const struct powerfail_ops *ops, void *ctx,
+		  FILE *out, struct powerfail_result *r)
+{
+	const unsigned int log2_bs = dev->log2_block_size;
+	struct powerfail_device pf;
+	struct mem_device m;
+	uint8_t *image = malloc(num_blocks << log2_bs);
+	ufat_block_t *sizes = NULL;
+	unsigned int i;
+	int ret = -1;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	m.base.log2_block_size = log2_bs;
+	m.base.read = mem_read;
+	m.base.write = mem_write;
+	m.data = malloc(num_blocks << log2_bs);
+	m.num_blocks = num_blocks;
+
+	if (!image || !m.data) {
+		perror("powerfail: malloc");
+		goto out;
+	}
+
+	if (dev->read(dev, 0, num_blocks, image) < 0) {
+		fprintf(stderr, "powerfail: can't read image\n");
+		goto out;
+	}
+
+	/* Record the write stream without cutting power */
+	powerfail_init(&pf, &m.base);
+	err = run_once(&m, image, &pf, ops, ctx);
+	if (err < 0) {
+		fprintf(stderr, "powerfail: workload failed: %s\n",
+			ufat_strerror(err));
+		goto out;
+	}
+
+	r->writes = pf.requests;
+	sizes = malloc((r->writes + 1) * sizeof(sizes[0]));
+	if (!sizes) {
+		perror("powerfail: malloc");
+		goto out;
+	}
+
+	powerfail_init(&pf, &m.base);
+	pf.sizes = sizes;
+	pf.max_sizes = r->writes;
+	run_once(&m, image, &pf, ops, ctx);
+
+	if (pf.requests != r->writes) {
+		fprintf(stderr, "powerfail: workload isn't deterministic\n");
+		goto out;
+	}
+
+	for (i = 0; i <= r->writes; i++) {
+		check_cut(&m, image, i, 0, ops, ctx, out, r);
+
+		if (tear && i < r->writes && sizes[i] > 1)
+			check_cut(&m, image, i, sizes[i] / 2, ops, ctx, out, r);
+	}
+
+	ret = 0;
+out:
+	free(image);
+	free(m.data);
+	free(sizes);
+	return ret;
+}
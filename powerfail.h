@@ -0,0 +1,117 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef POWERFAIL_H_
+#define POWERFAIL_H_
+
+/* Power-fail simulation for host builds.
+ *
+ * A powerfail_device passes requests through to another device, counting
+ * write requests as it goes. Power can be cut after any number of them:
+ * from then on, every request fails and nothing more reaches the device.
+ * The request at the cut may also be torn, with only its first few blocks
+ * written.
+ *
+ * powerfail_run() uses this to check that a workload leaves a consistent
+ * filesystem wherever power is cut. The workload is first run once to
+ * record its write stream. It's then run again on a fresh copy of the
+ * image for each possible cut, and each resulting image is remounted and
+ * checked with fscheck_run().
+ */
+
+#include <stdio.h>
+#include "ufat.h"
+
+#define POWERFAIL_NEVER		(~0u)
+
+struct powerfail_device {
+	struct ufat_device		base;
+	const struct ufat_device	*dev;
+
+	/* Write requests and blocks passed through so far */
+	unsigned int			requests;
+	ufat_block_t			blocks;
+
+	/* Power is cut after this many write requests. Of the request at
+	 * the cut, only the first tear blocks are written.
+	 */
+	unsigned int			cut;
+	ufat_block_t			tear;
+
+	/* If not NULL, the size of each write request is recorded here, up
+	 * to max_sizes requests.
+	 */
+	ufat_block_t			*sizes;
+	unsigned int			max_sizes;
+};
+
+/* Wrap the given device. Power is never cut until cut is set. */
+void powerfail_init(struct powerfail_device *pf,
+		    const struct ufat_device *dev);
+
+struct powerfail_ops {
+	/* Prepare a freshly opened filesystem, for example by attaching an
+	 * intent log or setting cache options. This is called before each
+	 * run of the workload, and again before each check, so that a log
+	 * can be replayed.
+	 */
+	int	(*setup)(void *ctx, struct ufat *uf);
+
+	/* Make some changes to the filesystem. A negative return value is
+	 * an error, which stops the test if it happens without a cut.
+	 */
+	int	(*workload)(void *ctx, struct ufat *uf);
+};
+
+struct powerfail_result {
+	unsigned int		writes;
+	unsigned int		runs;
+	unsigned int		failed;
+	unsigned int		warned;
+};
+
+/* Run the workload against a copy of the first num_blocks blocks of the
+ * given device, cutting power after each of its write requests in turn.
+ * If tear is non-zero, each multi-block request is also cut half way.
+ * The device itself is never written.
+ *
+ * Each failed cut is described on the given stream, if it's not NULL.
+ *
+ * Returns 0 if the test ran (whether or not any cut failed), or -1 if it
+ * couldn't be completed.
+ */
+int powerfail_run(const struct ufat_device *dev, ufat_block_t num_blocks,
+		  int tear, const struct powerfail_ops *ops, void *ctx,
+		  FILE *out, struct powerfail_result *r);
+
+#endif
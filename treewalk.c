@@ -0,0 +1,397 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "treewalk.h"
+
+struct task {
+	struct ufat_dirent	ent;
+	char			*path;
+};
+
+struct deque {
+	pthread_mutex_t		lock;
+	struct task		*tasks;
+	unsigned int		head;
+	unsigned int		count;
+	unsigned int		capacity;
+};
+
+struct worker {
+	struct walk		*w;
+	unsigned int		id;
+	pthread_t		tid;
+	struct deque		dq;
+	struct ufat		uf;
+};
+
+struct walk {
+	const struct ufat_device *dev;
+	treewalk_func_t		func;
+	void			*ctx;
+
+	unsigned int		num_workers;
+	struct worker		*workers;
+
+	/* Tasks queued or being processed. The walk is finished when this
+	 * drops to zero.
+	 */
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	unsigned int		outstanding;
+	int			err;
+};
+
+static int deque_push(struct deque *d, const struct task *t)
+{
+	pthread_mutex_lock(&d->lock);
+
+	if (d->count >= d->capacity) {
+		const unsigned int new_cap = d->capacity ? d->capacity * 2 : 64;
+		struct task *n = malloc(new_cap * sizeof(n[0]));
+		unsigned int i;
+
+		if (!n) {
+			pthread_mutex_unlock(&d->lock);
+			perror("treewalk: malloc");
+			return -1;
+		}
+
+		for (i = 0; i < d->count; i++)
+			n[i] = d->tasks[(d->head + i) % d->capacity];
+
+		free(d->tasks);
+		d->tasks = n;
+		d->head = 0;
+		d->capacity = new_cap;
+	}
+
+	d->tasks[(d->head + d->count) % d->capacity] = *t;
+	d->count++;
+
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+/* Owners take from the tail, thieves from the head. */
+static int deque_take(struct deque *d, struct task *t, int steal)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&d->lock);
+
+	if (d->count) {
+		if (steal) {
+			*t = d->tasks[d->head];
+			d->head = (d->head + 1) % d->capacity;
+		} else {
+			*t = d->tasks[(d->head + d->count - 1) % d->capacity];
+		}
+
+		d->count--;
+		ret = 1;
+	}
+
+	pthread_mutex_unlock(&d->lock);
+	return ret;
+}
+
+static int walk_error(struct walk *w)
+{
+	int err;
+
+	pthread_mutex_lock(&w->lock);
+	err = w->err;
+	pthread_mutex_unlock(&w->lock);
+
+	return err;
+}
+
+static void task_done(struct walk *w, int err)
+{
+	pthread_mutex_lock(&w->lock);
+
+	if (err < 0 && !w->err)
+		w->err = err;
+
+	if (!--w->outstanding)
+		pthread_cond_broadcast(&w->cond);
+
+	pthread_mutex_unlock(&w->lock);
+}
+
+static int queue_task(struct worker *wk, const struct ufat_dirent *ent,
+		      const char *path)
+{
+	struct walk *w = wk->w;
+	struct task t;
+
+	t.ent = *ent;
+	t.path = strdup(path);
+	if (!t.path) {
+		perror("treewalk: strdup");
+		return -1;
+	}
+
+	pthread_mutex_lock(&w->lock);
+	w->outstanding++;
+	pthread_mutex_unlock(&w->lock);
+
+	if (deque_push(&wk->dq, &t) < 0) {
+		free(t.path);
+		task_done(w, -1);
+		return -1;
+	}
+
+	/* Idle workers check the deques again with the lock held before
+	 * waiting, so signalling under it means no wakeup is lost.
+	 */
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+static int scan_dir(struct worker *wk, const struct task *t)
+{
+	struct walk *w = wk->w;
+	struct ufat_directory dir;
+	int err;
+
+	err = ufat_open_subdir(&wk->uf, &dir, &t->ent);
+	if (err < 0) {
+		fprintf(stderr, "treewalk: %s: %s\n", t->path,
+			ufat_strerror(err));
+		return err;
+	}
+
+	for (;;) {
+		char name[UFAT_LFN_MAX_UTF8];
+		char path[4096];
+		struct ufat_dirent ent;
+
+		err = ufat_dir_read(&dir, &ent, name, sizeof(name));
+		if (err < 0) {
+			fprintf(stderr, "treewalk: %s: %s\n", t->path,
+				ufat_strerror(err));
+			return err;
+		}
+
+		if (err)
+			break;
+
+		if (ent.short_name[0] == '.')
+			continue;
+
+		if (walk_error(w))
+			return -1;
+
+		if (snprintf(path, sizeof(path), "%s/%s", t->path, name) >=
+		    (int)sizeof(path)) {
+			fprintf(stderr, "treewalk: %s/%s: path too long\n",
+				t->path, name);
+			return -1;
+		}
+
+		err = w->func(w->ctx, &ent, path);
+		if (err < 0)
+			return err;
+
+		if ((ent.attributes & UFAT_ATTR_DIRECTORY) &&
+		    queue_task(wk, &ent, path) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int find_task(struct worker *wk, struct task *t)
+{
+	struct walk *w = wk->w;
+	unsigned int i;
+
+	if (deque_take(&wk->dq, t, 0))
+		return 1;
+
+	for (i = 1; i < w->num_workers; i++) {
+		struct worker *victim =
+			&w->workers[(wk->id + i) % w->num_workers];
+
+		if (deque_take(&victim->dq, t, 1))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *wk = arg;
+	struct walk *w = wk->w;
+
+	for (;;) {
+		struct task t;
+		int err;
+
+		/* If there's nothing to do, wait until either more work
+		 * appears or everything is finished. The deques are searched
+		 * again with the lock held, since new tasks are signalled
+		 * under it.
+		 */
+		if (!find_task(wk, &t)) {
+			pthread_mutex_lock(&w->lock);
+
+			for (;;) {
+				if (!w->outstanding) {
+					pthread_mutex_unlock(&w->lock);
+					return NULL;
+				}
+
+				if (find_task(wk, &t))
+					break;
+
+				pthread_cond_wait(&w->cond, &w->lock);
+			}
+
+			pthread_mutex_unlock(&w->lock);
+		}
+
+		err = walk_error(w) ? 0 : scan_dir(wk, &t);
+		free(t.path);
+		task_done(w, err);
+	}
+}
+
+int treewalk_run(const struct ufat_device *dev,
+		 const struct ufat_dirent *ent, unsigned int threads,
+		 treewalk_func_t func, void *ctx)
+{
+	struct ufat_dirent root;
+	struct walk w;
+	unsigned int opened = 0;
+	unsigned int started = 0;
+	unsigned int i;
+
+	if (!threads) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = n > 0 ? n : 1;
+	}
+
+	if (!ent) {
+		memset(&root, 0, sizeof(root));
+		root.dirent_block = UFAT_BLOCK_NONE;
+		root.attributes = UFAT_ATTR_DIRECTORY;
+		ent = &root;
+	}
+
+	w.dev = dev;
+	w.func = func;
+	w.ctx = ctx;
+	w.num_workers = threads;
+	w.outstanding = 0;
+	w.err = 0;
+
+	w.workers = calloc(threads, sizeof(w.workers[0]));
+	if (!w.workers) {
+		perror("treewalk: calloc");
+		return -1;
+	}
+
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+
+	for (i = 0; i < threads; i++) {
+		struct worker *wk = &w.workers[i];
+
+		wk->w = &w;
+		wk->id = i;
+		pthread_mutex_init(&wk->dq.lock, NULL);
+	}
+
+	/* Each worker gets a private mount, and therefore a private cache */
+	for (opened = 0; opened < threads; opened++) {
+		int err = ufat_open(&w.workers[opened].uf, dev);
+
+		if (err < 0) {
+			fprintf(stderr, "treewalk: ufat_open: %s\n",
+				ufat_strerror(err));
+			w.err = err;
+			break;
+		}
+	}
+
+	if (!w.err)
+		queue_task(&w.workers[0], ent, "");
+
+	for (i = 0; !w.err && i < threads; i++) {
+		if (pthread_create(&w.workers[i].tid, NULL, worker_main,
+				   &w.workers[i])) {
+			fprintf(stderr, "treewalk: failed to create thread\n");
+			break;
+		}
+
+		started++;
+	}
+
+	/* If no threads could be started, do the work here */
+	if (!w.err && !started)
+		worker_main(&w.workers[0]);
+
+	for (i = 0; i < started; i++)
+		pthread_join(w.workers[i].tid, NULL);
+
+	for (i = 0; i < opened; i++)
+		ufat_close(&w.workers[i].uf);
+
+	for (i = 0; i < threads; i++) {
+		struct worker *wk = &w.workers[i];
+		struct task t;
+
+		while (deque_take(&wk->dq, &t, 0))
+			free(t.path);
+
+		free(wk->dq.tasks);
+		pthread_mutex_destroy(&wk->dq.lock);
+	}
+
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.lock);
+	free(w.workers);
+
+	return w.err;
+}
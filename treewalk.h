@@ -0,0 +1,70 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TREEWALK_H_
+#define TREEWALK_H_
+
+/* Parallel directory tree walker for host builds.
+ *
+ * Each worker thread mounts its own struct ufat on the given device, so
+ * that no cache is shared between threads. The device's read function must
+ * therefore be safe to call concurrently. Directories waiting to be scanned
+ * are kept in per-worker deques: a worker pushes and pops subdirectories
+ * at the tail of its own deque, and steals from the head of other workers'
+ * deques when its own is empty.
+ *
+ * Any modifications made through another struct ufat must be synced to
+ * the device before walking.
+ */
+
+#include "ufat.h"
+
+/* Called once for each entry in the tree, other than "." and "..". The
+ * path is relative to the root of the walk. This is called concurrently
+ * from all worker threads. A negative return value stops the walk.
+ */
+typedef int (*treewalk_func_t)(void *ctx, const struct ufat_dirent *ent,
+			       const char *path);
+
+/* Walk the tree rooted at the given directory entry, or at the root
+ * directory if ent is NULL. If threads is 0, one thread is used per online
+ * CPU.
+ *
+ * Returns 0 on success, or a negative value if the walk failed or was
+ * stopped by the callback.
+ */
+int treewalk_run(const struct ufat_device *dev,
+		 const struct ufat_dirent *ent, unsigned int threads,
+		 treewalk_func_t func, void *ctx);
+
+#endif
@@ -35,54 +35,340 @@
 #include "ufat.h"
 #include "ufat_internal.h"
 
-static int cache_flush(struct ufat *uf, unsigned int cache_index)
+static int cache_find(const struct ufat *uf, ufat_block_t blk_index);
+
+static inline int cache_holds(const struct ufat *uf,
+			      const struct ufat_cache_desc *d)
 {
-	struct ufat_cache_desc *d = &uf->cache_desc[cache_index];
+	return (d->flags & UFAT_CACHE_FLAG_PRESENT) && d->owner == uf;
+}
 
-	if (!(d->flags & UFAT_CACHE_FLAG_DIRTY) ||
-	    !(d->flags & UFAT_CACHE_FLAG_PRESENT))
-		return 0;
+#ifndef UFAT_READ_ONLY
+/* Write back a run of dirty blocks, held in consecutive slots, which belong
+ * to the same filesystem and are consecutive on its device.
+ */
+static int cache_flush_run(struct ufat_cache *c, unsigned int first,
+			   unsigned int count)
+{
+	struct ufat *uf = c->desc[first].owner;
+	const ufat_block_t start = c->desc[first].index;
+	const ufat_block_t fat_end = uf->bpb.fat_start + uf->bpb.fat_size;
+	ufat_block_t lo = start;
+	ufat_block_t hi = start + count;
+	unsigned int i;
 
-	if (uf->dev->write(uf->dev, d->index, 1,
-			   ufat_cache_data(uf, cache_index)) < 0)
+	/* The blocks may belong to any of the filesystems sharing the cache,
+	 * so they're written back through their owner's device.
+	 */
+	if (ufat_dev_write(uf, UFAT_IO_WRITEBACK, start, count,
+			   ufat_cache_data(uf, first)) < 0)
 		return -UFAT_ERR_IO;
 
-	uf->stat.cache_flush++;
+	uf->stat.cache_flush += count;
 	uf->stat.write++;
-	uf->stat.write_blocks++;
+	uf->stat.write_blocks += count;
 
-	/* If this block is part of the FAT, mirror it to the other FATs. Not
-	 * a fatal error if this fails.
+	/* If any of these blocks are part of the FAT, mirror them to the
+	 * other FATs. Not a fatal error if this fails.
 	 */
-	if (d->index >= uf->bpb.fat_start &&
-	    d->index < uf->bpb.fat_start + uf->bpb.fat_size) {
-		unsigned int i;
-		ufat_block_t b = d->index;
+	if (lo < uf->bpb.fat_start)
+		lo = uf->bpb.fat_start;
+	if (hi > fat_end)
+		hi = fat_end;
+
+	if (lo < hi) {
+		ufat_block_t b = lo;
 
 		for (i = 1; i < uf->bpb.fat_count; i++) {
 			b += uf->bpb.fat_size;
-			uf->dev->write(uf->dev, b, 1,
-				       ufat_cache_data(uf, cache_index));
+			ufat_dev_write(uf, UFAT_IO_WRITEBACK, b, hi - lo,
+				       ufat_cache_data(uf, first + lo - start));
 
 			uf->stat.write++;
-			uf->stat.write_blocks++;
+			uf->stat.write_blocks += hi - lo;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		c->desc[first + i].flags &= ~UFAT_CACHE_FLAG_DIRTY;
+
+	return 0;
+}
+
+static inline int cache_dirty(const struct ufat *uf,
+			      const struct ufat_cache_desc *d)
+{
+	return cache_holds(uf, d) && (d->flags & UFAT_CACHE_FLAG_DIRTY);
+}
+
+/* How many barriers ago was this block last dirtied? */
+static inline unsigned int epoch_age(const struct ufat *uf,
+				     const struct ufat_cache_desc *d)
+{
+	return uf->epoch - d->epoch;
+}
+
+/* Find the oldest epoch, younger than the given age, which still has dirty
+ * blocks. Returns non-zero and its age if there is one.
+ */
+static int dirty_epoch_below(const struct ufat *uf, unsigned int limit,
+			     unsigned int *age)
+{
+	const struct ufat_cache *c = uf->cache;
+	int found = 0;
+	unsigned int i;
+
+	for (i = 0; i < c->size; i++) {
+		const struct ufat_cache_desc *d = &c->desc[i];
+		const unsigned int a = epoch_age(uf, d);
+
+		if (cache_dirty(uf, d) && a < limit && (!found || a > *age)) {
+			*age = a;
+			found = 1;
+		}
+	}
+
+	return found;
+}
+
+/* Write back all of a filesystem's dirty blocks from epochs older than the
+ * given age, oldest first.
+ */
+static int cache_flush_older(struct ufat *uf, unsigned int age)
+{
+	struct ufat_cache *c = uf->cache;
+	unsigned int oldest;
+
+	while (dirty_epoch_below(uf, ~0u, &oldest) && oldest > age) {
+		unsigned int i;
+
+		for (i = 0; i < c->size; i++) {
+			const struct ufat_cache_desc *d = &c->desc[i];
+
+			if (cache_dirty(uf, d) && epoch_age(uf, d) == oldest) {
+				int err = cache_flush_run(c, i, 1);
+
+				if (err < 0)
+					return err;
+			}
 		}
 	}
 
-	d->flags &= ~UFAT_CACHE_FLAG_DIRTY;
+	return 0;
+}
+
+/* Intent log layout. The first block of the log area holds a header,
+ * followed by the home block index of each logged block (8 bytes each).
+ * Copies of the logged blocks follow in the remaining blocks of the area.
+ */
+#define LOG_MAGIC		"uFATLOG"
+#define LOG_MAGIC_SIZE		8
+#define LOG_HDR_SEQ		0x08
+#define LOG_HDR_COUNT		0x0c
+#define LOG_HDR_CHECKSUM	0x10
+#define LOG_HDR_SIZE		0x14
+
+static unsigned int log_capacity(const struct ufat *uf, unsigned int count)
+{
+	const unsigned int per_block =
+		((1u << uf->dev->log2_block_size) - LOG_HDR_SIZE) >> 3;
+
+	return count - 1 < per_block ? count - 1 : per_block;
+}
+
+static uint32_t log_checksum(const uint8_t *hdr, unsigned int n)
+{
+	const unsigned int len = LOG_HDR_SIZE + (n << 3);
+	uint32_t h = 2166136261u;
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		if (i >= LOG_HDR_CHECKSUM && i < LOG_HDR_SIZE)
+			continue;
+
+		h = (h ^ hdr[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+static ufat_block_t log_entry(const uint8_t *hdr, unsigned int k)
+{
+	const uint8_t *e = hdr + LOG_HDR_SIZE + (k << 3);
+
+	return r32(e) | ((ufat_block_t)r32(e + 4) << 32);
+}
+
+static int log_write(struct ufat *uf, ufat_block_t blk, const void *data)
+{
+	if (ufat_dev_write(uf, UFAT_IO_METADATA, blk, 1, data) < 0)
+		return -UFAT_ERR_IO;
+
+	uf->stat.write++;
+	uf->stat.write_blocks++;
+	return 0;
+}
+
+/* Copy dirty blocks to the log, oldest epoch first, until it holds cap
+ * blocks. Their home indices are recorded in the header.
+ */
+static int log_gather(struct ufat *uf, unsigned int cap, unsigned int *n)
+{
+	struct ufat_cache *c = uf->cache;
+	unsigned int limit = ~0u;
+	unsigned int age;
+
+	while (*n < cap && dirty_epoch_below(uf, limit, &age)) {
+		unsigned int i;
+
+		for (i = 0; i < c->size && *n < cap; i++) {
+			const struct ufat_cache_desc *d = &c->desc[i];
+			uint8_t *e = uf->log_buf + LOG_HDR_SIZE + (*n << 3);
+			int err;
+
+			if (!cache_dirty(uf, d) || epoch_age(uf, d) != age)
+				continue;
+
+			err = log_write(uf, uf->log_start + 1 + *n,
+					ufat_cache_data(uf, i));
+			if (err < 0)
+				return err;
+
+			w32(e, d->index);
+			w32(e + 4, d->index >> 32);
+			(*n)++;
+		}
+
+		limit = age;
+	}
+
+	return 0;
+}
+
+/* Write back up to cap of a filesystem's dirty blocks, oldest epoch first,
+ * as one batch via the intent log. The batch is copied to the log and
+ * committed by writing the header, before any block is written home. The
+ * header is cleared once they all are. Returns the number of blocks
+ * written back, which is 0 if none were dirty.
+ */
+static int log_commit_batch(struct ufat *uf, unsigned int cap)
+{
+	struct ufat_cache *c = uf->cache;
+	uint8_t *hdr = uf->log_buf;
+	unsigned int n = 0;
+	unsigned int i;
+	int err;
+
+	err = log_gather(uf, cap, &n);
+	if (err < 0)
+		return err;
+
+	if (!n)
+		return 0;
+
+	memcpy(hdr, LOG_MAGIC, LOG_MAGIC_SIZE);
+	w32(hdr + LOG_HDR_SEQ, ++uf->log_seq);
+	w32(hdr + LOG_HDR_COUNT, n);
+	w32(hdr + LOG_HDR_CHECKSUM, log_checksum(hdr, n));
+
+	err = log_write(uf, uf->log_start, hdr);
+	if (err < 0)
+		return err;
+
+	for (i = 0; i < n; i++) {
+		const int idx = cache_find(uf, log_entry(hdr, i));
+
+		err = cache_flush_run(c, idx, 1);
+		if (err < 0)
+			return err;
+	}
+
+	if (uf->dispatch && uf->dispatch->sync(uf->dispatch) < 0)
+		return -UFAT_ERR_IO;
+
+	memset(hdr, 0, LOG_MAGIC_SIZE);
+	err = log_write(uf, uf->log_start, hdr);
+	if (err < 0)
+		return err;
+
+	return n;
+}
+
+/* Write back all of a filesystem's dirty blocks via the intent log.
+ *
+ * If more than one batch is needed, they're split in epoch order, and
+ * each batch is home before the next is logged, so no block reaches its
+ * home ahead of one dirtied before an earlier barrier. Deletes remove the
+ * entry before freeing clusters, and allocations link clusters before an
+ * entry points at them, so an interruption between batches can leak
+ * clusters but never leaves an entry pointing at a free one.
+ */
+static int log_commit(struct ufat *uf)
+{
+	const unsigned int cap = log_capacity(uf, uf->log_count);
+	int n;
+
+	do {
+		n = log_commit_batch(uf, cap);
+	} while (n > 0);
+
+	return n;
+}
+
+static int cache_flush(struct ufat_cache *c, unsigned int cache_index)
+{
+	const struct ufat_cache_desc *d = &c->desc[cache_index];
+	int err;
+
+	if (!(d->flags & UFAT_CACHE_FLAG_DIRTY) ||
+	    !(d->flags & UFAT_CACHE_FLAG_PRESENT))
+		return 0;
+
+	if (d->owner->log_count)
+		return log_commit(d->owner);
+
+	err = cache_flush_older(d->owner, epoch_age(d->owner, d));
+	if (err < 0)
+		return err;
+
+	return cache_flush_run(c, cache_index, 1);
+}
+
+int ufat_cache_write(struct ufat *uf, unsigned int cache_index)
+{
+	struct ufat_cache_desc *d = &uf->cache->desc[cache_index];
+
+	/* A block dirtied before the last barrier is about to change again.
+	 * Blocks dirtied since then may depend on what it holds now, so write
+	 * it back first. Otherwise, the next change could reach the disk
+	 * ahead of them.
+	 */
+	if ((d->flags & UFAT_CACHE_FLAG_DIRTY) &&
+	    d->epoch != uf->dirty_epoch) {
+		int err = cache_flush(uf->cache, cache_index);
+
+		if (err < 0)
+			return err;
+	}
+
+	uf->stat.cache_write++;
+	d->flags |= UFAT_CACHE_FLAG_DIRTY;
+	d->epoch = uf->epoch;
+	uf->dirty_epoch = uf->epoch;
 	return 0;
 }
 
 int ufat_cache_evict(struct ufat *uf, ufat_block_t start, ufat_block_t count)
 {
+	struct ufat_cache *c = uf->cache;
 	unsigned int i;
 
-	for (i = 0; i < uf->cache_size; i++) {
-		struct ufat_cache_desc *d = &uf->cache_desc[i];
+	for (i = 0; i < c->size; i++) {
+		struct ufat_cache_desc *d = &c->desc[i];
 
-		if ((d->flags & UFAT_CACHE_FLAG_PRESENT) &&
+		if (cache_holds(uf, d) &&
 		    d->index >= start && d->index < start + count) {
-			int err = cache_flush(uf, i);
+			int err = cache_flush(c, i);
 
 			if (err < 0)
 				return err;
@@ -93,42 +379,206 @@ int ufat_cache_evict(struct ufat *uf, ufat_block_t start, ufat_block_t count)
 
 	return 0;
 }
+#endif
 
 void ufat_cache_invalidate(struct ufat *uf, ufat_block_t start,
 			   ufat_block_t count)
 {
+	struct ufat_cache *c = uf->cache;
 	unsigned int i;
 
-	for (i = 0; i < uf->cache_size; i++) {
-		struct ufat_cache_desc *d = &uf->cache_desc[i];
+	for (i = 0; i < c->size; i++) {
+		struct ufat_cache_desc *d = &c->desc[i];
 
-		if ((d->flags & UFAT_CACHE_FLAG_PRESENT) &&
+		if (cache_holds(uf, d) &&
 		    d->index >= start && d->index < start + count)
 			d->flags = 0;
 	}
 }
 
+static int cache_find(const struct ufat *uf, ufat_block_t blk_index)
+{
+	const struct ufat_cache *c = uf->cache;
+	unsigned int i;
+
+	for (i = 0; i < c->size; i++) {
+		const struct ufat_cache_desc *d = &c->desc[i];
+
+		if (cache_holds(uf, d) && d->index == blk_index)
+			return i;
+	}
+
+	return -1;
+}
+
+/* First block past the data area. Cluster numbers start at 2, so this is
+ * cluster_start plus (num_clusters - 2) clusters, not num_clusters.
+ */
+static ufat_block_t fs_end(const struct ufat_bpb *bpb)
+{
+	return cluster_to_block(bpb, bpb->num_clusters);
+}
+
+/* Find the region holding the given block: the reserved area, one copy of
+ * the FAT, the FAT12/16 root directory or the data area. Anything past the
+ * end of the filesystem is a region of its own.
+ */
+static void block_region(const struct ufat_bpb *bpb, ufat_block_t blk_index,
+			 ufat_block_t *base, ufat_block_t *end)
+{
+	const ufat_block_t fat_end = bpb->fat_start +
+		bpb->fat_size * bpb->fat_count;
+
+	if (blk_index >= bpb->cluster_start) {
+		*base = bpb->cluster_start;
+		*end = fs_end(bpb);
+	} else if (bpb->root_size && blk_index >= bpb->root_start) {
+		*base = bpb->root_start;
+		*end = bpb->root_start + bpb->root_size;
+	} else if (blk_index >= bpb->fat_start && blk_index < fat_end) {
+		*base = blk_index - (blk_index - bpb->fat_start) %
+			bpb->fat_size;
+		*end = *base + bpb->fat_size;
+	} else if (blk_index < bpb->fat_start) {
+		*base = 0;
+		*end = bpb->fat_start;
+	} else {
+		*base = blk_index;
+		*end = blk_index + 1;
+	}
+
+	if (blk_index >= *end) {
+		*base = blk_index;
+		*end = blk_index + 1;
+	}
+}
+
+static int cache_fill_line(struct ufat *uf, ufat_block_t blk_index)
+{
+	struct ufat_cache *c = uf->cache;
+	const unsigned int line = 1 << uf->log2_cache_line;
+	ufat_block_t base;
+	ufat_block_t end;
+	ufat_block_t start;
+	ufat_block_t count = line;
+	unsigned int victim = 0;
+	unsigned int victim_age = 0;
+	unsigned int slot;
+	unsigned int i;
+	int ret = -1;
+
+	/* Lines are aligned relative to the start of their region, so that
+	 * in the data area they line up with clusters. They never cross
+	 * into the next region.
+	 */
+	block_region(&uf->bpb, blk_index, &base, &end);
+	start = base + ((blk_index - base) & ~(ufat_block_t)(line - 1));
+	if (start + count > end)
+		count = end - start;
+
+	/* Slots are recycled in aligned groups of one line. Pick the group
+	 * whose most recently used slot is the oldest. This never picks the
+	 * group holding the most recently used block.
+	 */
+	for (slot = 0; slot + line <= c->size; slot += line) {
+		unsigned int age = ~0u;
+
+		for (i = slot; i < slot + line; i++) {
+			const struct ufat_cache_desc *d = &c->desc[i];
+
+			if ((d->flags & UFAT_CACHE_FLAG_PRESENT) &&
+			    c->next_seq - d->seq < age)
+				age = c->next_seq - d->seq;
+		}
+
+		if (!slot || age > victim_age) {
+			victim = slot;
+			victim_age = age;
+		}
+	}
+
+	for (i = victim; i < victim + line; i++) {
+#ifndef UFAT_READ_ONLY
+		int err = cache_flush(c, i);
+
+		if (err < 0)
+			return err;
+#endif
+
+		c->desc[i].flags = 0;
+	}
+
+	/* Read the parts of the line which aren't already cached. Usually
+	 * that's all of it, in a single request.
+	 */
+	slot = victim;
+	while (count) {
+		ufat_block_t n = 0;
+
+		if (cache_find(uf, start) >= 0) {
+			start++;
+			count--;
+			continue;
+		}
+
+		while (n < count && cache_find(uf, start + n) < 0)
+			n++;
+
+		if (ufat_dev_read(uf, UFAT_IO_METADATA, start, n,
+				  ufat_cache_data(uf, slot)) < 0)
+			return -UFAT_ERR_IO;
+
+		uf->stat.read++;
+		uf->stat.read_blocks += n;
+
+		for (i = 0; i < n; i++) {
+			struct ufat_cache_desc *d = &c->desc[slot + i];
+
+			d->flags = UFAT_CACHE_FLAG_PRESENT;
+			d->index = start + i;
+			d->owner = uf;
+			d->seq = c->next_seq++;
+
+			if (d->index == blk_index)
+				ret = slot + i;
+		}
+
+		slot += n;
+		start += n;
+		count -= n;
+	}
+
+	c->desc[ret].seq = c->next_seq++;
+	uf->stat.cache_miss++;
+
+	return ret;
+}
+
 int ufat_cache_open(struct ufat *uf, ufat_block_t blk_index, int skip_read)
 {
+	struct ufat_cache *c = uf->cache;
 	unsigned int i;
 	int oldest = -1;
 	int free = -1;
 	int err;
 	unsigned int oldest_age = 0;
+#ifndef UFAT_READ_ONLY
+	int oldest_clean = -1;
+	unsigned int oldest_clean_age = 0;
+#endif
 
 	/* Scan the cache, looking for:
 	 *
 	 *   (a) the item, if we already have it.
 	 *   (b) a free slot, if one exists.
-	 *   (c) the oldest cache item.
+	 *   (c) the oldest cache item, whichever filesystem it belongs to.
 	 */
-	for (i = 0; i < uf->cache_size; i++) {
-		struct ufat_cache_desc *d = &uf->cache_desc[i];
-		unsigned int age = uf->next_seq - d->seq;
+	for (i = 0; i < c->size; i++) {
+		struct ufat_cache_desc *d = &c->desc[i];
+		unsigned int age = c->next_seq - d->seq;
 
-		if ((d->flags & UFAT_CACHE_FLAG_PRESENT) &&
-		    d->index == blk_index) {
-			d->seq = uf->next_seq++;
+		if (cache_holds(uf, d) && d->index == blk_index) {
+			d->seq = c->next_seq++;
 			uf->stat.cache_hit++;
 			return i;
 		}
@@ -140,25 +590,46 @@ int ufat_cache_open(struct ufat *uf, ufat_block_t blk_index, int skip_read)
 			oldest_age = age;
 			oldest = i;
 		}
+
+#ifndef UFAT_READ_ONLY
+		if (!(d->flags & UFAT_CACHE_FLAG_DIRTY) &&
+		    (oldest_clean < 0 || age > oldest_clean_age)) {
+			oldest_clean_age = age;
+			oldest_clean = i;
+		}
+#endif
 	}
 
+#ifndef UFAT_READ_ONLY
+	/* With an intent log, each flush is a commit, so avoid evicting
+	 * dirty blocks while clean ones are available.
+	 */
+	if (uf->log_count && oldest_clean >= 0)
+		oldest = oldest_clean;
+#endif
+
 	/* We don't have the item. Find a place to put it. */
+	if (!skip_read && uf->log2_cache_line)
+		return cache_fill_line(uf, blk_index);
+
 	if (free >= 0) {
 		i = free;
 	} else {
-		err = cache_flush(uf, oldest);
+#ifndef UFAT_READ_ONLY
+		err = cache_flush(c, oldest);
 		if (err < 0)
 			return err;
+#endif
 
 		i = oldest;
 	}
 
 	if (skip_read == 0) {
 		/* Read it in */
-		err = uf->dev->read(uf->dev, blk_index, 1,
+		err = ufat_dev_read(uf, UFAT_IO_METADATA, blk_index, 1,
 				    ufat_cache_data(uf, i));
 		if (err < 0) {
-			uf->cache_desc[i].flags = 0;
+			c->desc[i].flags = 0;
 			return err;
 		}
 
@@ -168,16 +639,94 @@ int ufat_cache_open(struct ufat *uf, ufat_block_t blk_index, int skip_read)
 		memset(ufat_cache_data(uf, i), 0,
 		       1 << uf->dev->log2_block_size);
 
-	struct ufat_cache_desc *d = &uf->cache_desc[i];
+	struct ufat_cache_desc *d = &c->desc[i];
 	d->flags = UFAT_CACHE_FLAG_PRESENT;
 	d->index = blk_index;
-	d->seq = uf->next_seq++;
+	d->owner = uf;
+	d->seq = c->next_seq++;
 
 	uf->stat.cache_miss++;
 
 	return i;
 }
 
+static unsigned int find_free_run(const struct ufat_cache *c,
+				  unsigned int want, unsigned int *first)
+{
+	unsigned int best = 0;
+	unsigned int run = 0;
+	unsigned int i;
+
+	for (i = 0; i < c->size; i++) {
+		if (c->desc[i].flags & UFAT_CACHE_FLAG_PRESENT) {
+			run = 0;
+			continue;
+		}
+
+		run++;
+		if (run > best) {
+			best = run;
+			*first = i + 1 - run;
+
+			if (best >= want)
+				return want;
+		}
+	}
+
+	return best;
+}
+
+int ufat_cache_prefetch(struct ufat *uf, ufat_block_t start,
+			ufat_block_t count)
+{
+	struct ufat_cache *c = uf->cache;
+
+	while (count) {
+		unsigned int want = 1;
+		unsigned int first;
+		unsigned int n;
+		unsigned int i;
+
+		if (cache_find(uf, start) >= 0) {
+			start++;
+			count--;
+			continue;
+		}
+
+		/* Cache slot data is contiguous, so a run of free slots can
+		 * be filled with a single read.
+		 */
+		while (want < count && want < c->size &&
+		       cache_find(uf, start + want) < 0)
+			want++;
+
+		n = find_free_run(c, want, &first);
+		if (!n)
+			break;
+
+		if (ufat_dev_read(uf, UFAT_IO_PREFETCH, start, n,
+				  ufat_cache_data(uf, first)) < 0)
+			return -UFAT_ERR_IO;
+
+		uf->stat.read++;
+		uf->stat.read_blocks += n;
+
+		for (i = 0; i < n; i++) {
+			struct ufat_cache_desc *d = &c->desc[first + i];
+
+			d->flags = UFAT_CACHE_FLAG_PRESENT;
+			d->index = start + i;
+			d->owner = uf;
+			d->seq = c->next_seq++;
+		}
+
+		start += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
 static int log2_exact(unsigned int e, unsigned int *ret)
 {
 	unsigned int count = 0;
@@ -297,49 +846,439 @@ static int read_bpb(struct ufat *uf)
 			 ufat_cache_data(uf, idx));
 }
 
+void ufat_cache_init(struct ufat_cache *c, unsigned int log2_block_size,
+		     struct ufat_cache_desc *desc, uint8_t *data,
+		     unsigned int blocks)
+{
+	c->log2_block_size = log2_block_size;
+	c->size = blocks;
+	c->next_seq = 0;
+	c->desc = desc;
+	c->data = data;
+
+	memset(desc, 0, sizeof(desc[0]) * blocks);
+}
+
+/* Forget all of this filesystem's blocks in a shared cache */
+static void cache_drop(struct ufat *uf)
+{
+	struct ufat_cache *c = uf->cache;
+	unsigned int i;
+
+	for (i = 0; i < c->size; i++)
+		if (c->desc[i].owner == uf)
+			c->desc[i].flags = 0;
+}
+
+#ifndef UFAT_NO_LOCAL_CACHE
 int ufat_open(struct ufat *uf, const struct ufat_device *dev)
 {
-	uf->dev = dev;
+	unsigned int blocks = UFAT_CACHE_BYTES >> dev->log2_block_size;
 
-	uf->next_seq = 0;
-	uf->cache_size = UFAT_CACHE_BYTES >> dev->log2_block_size;
+	if (blocks > UFAT_CACHE_MAX_BLOCKS)
+		blocks = UFAT_CACHE_MAX_BLOCKS;
 
-	if (uf->cache_size > UFAT_CACHE_MAX_BLOCKS)
-		uf->cache_size = UFAT_CACHE_MAX_BLOCKS;
+	if (!blocks)
+		return -UFAT_ERR_BLOCK_SIZE;
+
+	ufat_cache_init(&uf->local_cache, dev->log2_block_size,
+			uf->cache_desc, uf->cache_data, blocks);
 
-	if (!uf->cache_size)
+	return ufat_open_shared(uf, dev, &uf->local_cache);
+}
+#endif
+
+int ufat_open_shared(struct ufat *uf, const struct ufat_device *dev,
+		     struct ufat_cache *cache)
+{
+	int err;
+
+	if (dev->log2_block_size != cache->log2_block_size || !cache->size)
 		return -UFAT_ERR_BLOCK_SIZE;
 
+	uf->dev = dev;
+	uf->cache = cache;
+	uf->dispatch = NULL;
+	uf->map = NULL;
+	uf->log2_cache_line = 0;
+#ifndef UFAT_READ_ONLY
+	uf->log_count = 0;
+	uf->epoch = 0;
+	uf->dirty_epoch = 0;
 	uf->alloc_ptr = 0;
+#endif
+	uf->free_summary = NULL;
+	uf->free_summary_blocks = 0;
+	uf->free_summary_done = 0;
 	memset(&uf->stat, 0, sizeof(uf->stat));
-	memset(&uf->cache_desc, 0, sizeof(uf->cache_desc));
 
-	return read_bpb(uf);
+	err = read_bpb(uf);
+	if (err < 0)
+		cache_drop(uf);
+
+	return err;
 }
 
-int ufat_sync(struct ufat *uf)
+#ifndef UFAT_READ_ONLY
+static int log_replay(struct ufat *uf, ufat_block_t start, uint8_t *hdr)
+{
+	const unsigned int n = r32(hdr + LOG_HDR_COUNT);
+	unsigned int k;
+
+	for (k = 0; k < n; k++) {
+		int idx = ufat_cache_open(uf, log_entry(hdr, k), 1);
+		int err;
+
+		if (idx < 0)
+			return idx;
+
+		err = ufat_cache_write(uf, idx);
+		if (err < 0)
+			return err;
+
+		if (ufat_dev_read(uf, UFAT_IO_METADATA, start + 1 + k, 1,
+				  ufat_cache_data(uf, idx)) < 0) {
+			uf->cache->desc[idx].flags = 0;
+			return -UFAT_ERR_IO;
+		}
+
+		uf->stat.read++;
+		uf->stat.read_blocks++;
+
+		err = cache_flush(uf->cache, idx);
+		if (err < 0)
+			return err;
+	}
+
+	if (uf->dispatch && uf->dispatch->sync(uf->dispatch) < 0)
+		return -UFAT_ERR_IO;
+
+	memset(hdr, 0, LOG_MAGIC_SIZE);
+	return log_write(uf, start, hdr);
+}
+
+int ufat_log_attach(struct ufat *uf, ufat_block_t start, unsigned int count,
+		    uint8_t *buf)
+{
+	unsigned int n;
+
+	if (count < 2 || !start || start + count > uf->bpb.fat_start)
+		return -UFAT_ERR_INVALID_LOG;
+
+	if (ufat_dev_read(uf, UFAT_IO_METADATA, start, 1, buf) < 0)
+		return -UFAT_ERR_IO;
+
+	uf->stat.read++;
+	uf->stat.read_blocks++;
+	uf->log_seq = 0;
+
+	/* A valid header means that a commit was interrupted. Its blocks
+	 * are complete in the log, so write them home again.
+	 */
+	n = r32(buf + LOG_HDR_COUNT);
+	if (!memcmp(buf, LOG_MAGIC, LOG_MAGIC_SIZE) &&
+	    n <= log_capacity(uf, count) &&
+	    r32(buf + LOG_HDR_CHECKSUM) == log_checksum(buf, n)) {
+		int err;
+
+		uf->log_seq = r32(buf + LOG_HDR_SEQ);
+		err = log_replay(uf, start, buf);
+		if (err < 0)
+			return err;
+	}
+
+	uf->log_start = start;
+	uf->log_count = count;
+	uf->log_buf = buf;
+
+	return 0;
+}
+#endif
+
+int ufat_set_cache_line(struct ufat *uf, unsigned int log2_blocks)
+{
+	/* At least two lines must fit in the cache */
+	if (log2_blocks && (2u << log2_blocks) > uf->cache->size)
+		return -UFAT_ERR_BLOCK_SIZE;
+
+	uf->log2_cache_line = log2_blocks;
+	return 0;
+}
+
+int ufat_prefetch_metadata(struct ufat *uf)
+{
+	const struct ufat_bpb *bpb = &uf->bpb;
+	ufat_block_t fat_blocks = 0;
+	unsigned int i;
+	int err;
+
+	/* Split the free part of the cache between the head of the FAT
+	 * and the root directory.
+	 */
+	for (i = 0; i < uf->cache->size; i++)
+		if (!(uf->cache->desc[i].flags & UFAT_CACHE_FLAG_PRESENT))
+			fat_blocks++;
+
+	fat_blocks = (fat_blocks + 1) >> 1;
+	if (fat_blocks > bpb->fat_size)
+		fat_blocks = bpb->fat_size;
+
+	err = ufat_cache_prefetch(uf, bpb->fat_start, fat_blocks);
+	if (err < 0)
+		return err;
+
+	if (bpb->root_cluster)
+		return ufat_cache_prefetch(uf,
+			cluster_to_block(bpb, bpb->root_cluster),
+			1 << bpb->log2_blocks_per_cluster);
+
+	return ufat_cache_prefetch(uf, bpb->root_start, bpb->root_size);
+}
+
+unsigned int ufat_cache_export(const struct ufat *uf, ufat_block_t *list,
+			       unsigned int max)
+{
+	const struct ufat_cache *c = uf->cache;
+	unsigned int last_age = 0;
+	unsigned int n = 0;
+
+	/* Most recently used first, so that a short list keeps the hottest
+	 * blocks. Present blocks all have distinct ages.
+	 */
+	while (n < max) {
+		int best = -1;
+		unsigned int best_age = 0;
+		unsigned int i;
+
+		for (i = 0; i < c->size; i++) {
+			const struct ufat_cache_desc *d = &c->desc[i];
+			const unsigned int age = c->next_seq - d->seq;
+
+			if (!cache_holds(uf, d) || (n && age <= last_age))
+				continue;
+
+			if (best < 0 || age < best_age) {
+				best = i;
+				best_age = age;
+			}
+		}
+
+		if (best < 0)
+			break;
+
+		last_age = best_age;
+		list[n++] = c->desc[best].index;
+	}
+
+	return n;
+}
+
+int ufat_cache_warm(struct ufat *uf, ufat_block_t *list, unsigned int count)
 {
+	const struct ufat_bpb *bpb = &uf->bpb;
+	const ufat_block_t end = fs_end(bpb);
 	unsigned int i;
-	int ret = 0;
 
-	for (i = 0; i < uf->cache_size; i++) {
-		int err = cache_flush(uf, i);
+	/* Sort the list, so that adjacent blocks can be merged */
+	for (i = 1; i < count; i++) {
+		const ufat_block_t b = list[i];
+		unsigned int j = i;
 
-		if (err)
-			ret = err;
+		while (j && list[j - 1] > b) {
+			list[j] = list[j - 1];
+			j--;
+		}
+
+		list[j] = b;
+	}
+
+	i = 0;
+	while (i < count) {
+		const ufat_block_t start = list[i];
+		ufat_block_t len = 1;
+		int err;
+
+		for (i++; i < count && list[i] <= start + len; i++)
+			if (list[i] == start + len)
+				len++;
+
+		/* The list may be stale, and refer to another volume */
+		if (start >= end)
+			break;
+		if (start + len > end)
+			len = end - start;
+
+		err = ufat_cache_prefetch(uf, start, len);
+		if (err < 0)
+			return err;
 	}
 
+	return 0;
+}
+
+#ifndef UFAT_READ_ONLY
+int ufat_sync(struct ufat *uf)
+{
+	/* Stop at the first failed write. Blocks from later epochs may depend
+	 * on it, so they mustn't be written either.
+	 */
+	int ret = ufat_sync_step(uf, ~0u);
+
+	if (uf->dispatch && uf->dispatch->sync(uf->dispatch) < 0)
+		ret = -UFAT_ERR_IO;
+
 	return ret;
 }
 
-int ufat_count_free_clusters(struct ufat *uf, ufat_cluster_t *free_clusters)
+/* Can block b be written back in the same request as block a, which
+ * precedes it by n blocks?
+ */
+static int same_run(const struct ufat *uf, const struct ufat_cache_desc *a,
+		    const struct ufat_cache_desc *b, unsigned int n)
+{
+	return cache_dirty(uf, a) && cache_dirty(uf, b) &&
+		a->epoch == b->epoch && a->index + n == b->index;
+}
+
+int ufat_sync_step(struct ufat *uf, unsigned int max_blocks)
+{
+	struct ufat_cache *c = uf->cache;
+
+	for (;;) {
+		int oldest = -1;
+		unsigned int oldest_epoch = 0;
+		unsigned int oldest_age = 0;
+		unsigned int first;
+		unsigned int count = 1;
+		unsigned int i;
+		int err;
+
+		/* Find the least recently used block of the oldest epoch */
+		for (i = 0; i < c->size; i++) {
+			const struct ufat_cache_desc *d = &c->desc[i];
+			const unsigned int epoch = epoch_age(uf, d);
+			const unsigned int age = c->next_seq - d->seq;
+
+			if (!cache_dirty(uf, d))
+				continue;
+
+			if (oldest < 0 || epoch > oldest_epoch ||
+			    (epoch == oldest_epoch && age > oldest_age)) {
+				oldest = i;
+				oldest_epoch = epoch;
+				oldest_age = age;
+			}
+		}
+
+		if (oldest < 0)
+			return 0;
+
+		if (!max_blocks)
+			return 1;
+
+		/* With a log, the budget limits the size of each batch */
+		if (uf->log_count) {
+			const unsigned int cap = log_capacity(uf,
+							      uf->log_count);
+
+			err = log_commit_batch(uf, max_blocks < cap ?
+					       max_blocks : cap);
+			if (err < 0)
+				return err;
+
+			max_blocks -= err;
+			continue;
+		}
+
+		/* Batch the oldest dirty block together with dirty neighbours
+		 * from the same epoch, where they sit in adjacent slots.
+		 */
+		first = oldest;
+		while (count < max_blocks && first > 0 &&
+		       same_run(uf, &c->desc[first - 1], &c->desc[first], 1)) {
+			first--;
+			count++;
+		}
+
+		while (count < max_blocks && first + count < c->size &&
+		       same_run(uf, &c->desc[first], &c->desc[first + count],
+				count))
+			count++;
+
+		err = cache_flush_run(c, first, count);
+		if (err < 0)
+			return err;
+
+		max_blocks -= count;
+	}
+}
+#endif
+
+#ifndef UFAT_READ_ONLY
+/* Which FAT block holds the (start of the) entry for the given cluster? */
+static unsigned int fat_entry_block(const struct ufat *uf, ufat_cluster_t index)
+{
+	const unsigned int log2_block_size = uf->dev->log2_block_size;
+
+	switch (uf->bpb.type) {
+	case UFAT_TYPE_FAT12: return ((index * 3) >> 1) >> log2_block_size;
+	case UFAT_TYPE_FAT16: return index >> (log2_block_size - 1);
+	case UFAT_TYPE_FAT32: return index >> (log2_block_size - 2);
+	}
+
+	return 0;
+}
+
+/* Which FAT block holds the end of the entry? FAT12 entries may straddle
+ * two blocks.
+ */
+static unsigned int fat_entry_last_block(const struct ufat *uf,
+					 ufat_cluster_t index)
+{
+	if (uf->bpb.type == UFAT_TYPE_FAT12)
+		return (((index * 3) >> 1) + 1) >> uf->dev->log2_block_size;
+
+	return fat_entry_block(uf, index);
+}
+
+int ufat_fat_same_block(const struct ufat *uf, ufat_cluster_t a,
+			ufat_cluster_t b)
+{
+	const unsigned int first = fat_entry_block(uf, a);
+
+	return fat_entry_last_block(uf, a) == first &&
+		fat_entry_block(uf, b) == first &&
+		fat_entry_last_block(uf, b) == first;
+}
+#endif
+
+/* First cluster whose FAT entry starts in the given FAT block */
+static ufat_cluster_t fat_block_first(const struct ufat *uf, unsigned int b)
+{
+	const unsigned int log2_block_size = uf->dev->log2_block_size;
+
+	switch (uf->bpb.type) {
+	case UFAT_TYPE_FAT12:
+		return (((ufat_cluster_t)b << log2_block_size) * 2 + 2) / 3;
+	case UFAT_TYPE_FAT16: return b << (log2_block_size - 1);
+	case UFAT_TYPE_FAT32: return b << (log2_block_size - 2);
+	}
+
+	return 0;
+}
+
+static int count_free_range(struct ufat *uf, ufat_cluster_t start,
+			    ufat_cluster_t *free_clusters)
 {
 	ufat_cluster_t idx;
 	ufat_cluster_t local_free_clusters = 0;
 	const ufat_cluster_t total = uf->bpb.num_clusters;
 
 	/* Skip first two "special" clusters */
-	for (idx = 2; idx < total; idx++) {
+	if (start < 2)
+		start = 2;
+
+	for (idx = start; idx < total; idx++) {
 		ufat_cluster_t c;
 		int err;
 
@@ -359,9 +1298,91 @@ int ufat_count_free_clusters(struct ufat *uf, ufat_cluster_t *free_clusters)
 	return 0;
 }
 
+int ufat_count_free_clusters(struct ufat *uf, ufat_cluster_t *free_clusters)
+{
+	ufat_cluster_t local_free_clusters = 0;
+	unsigned int i;
+	int err;
+
+	/* Summarized FAT blocks don't need to be read */
+	for (i = 0; i < uf->free_summary_done; i++)
+		local_free_clusters += uf->free_summary[i];
+
+	err = count_free_range(uf, fat_block_first(uf, i), free_clusters);
+	if (err < 0)
+		return err;
+
+	*free_clusters += local_free_clusters;
+	return 0;
+}
+
+void ufat_free_summary_begin(struct ufat *uf, uint16_t *counts,
+			     unsigned int max_blocks)
+{
+	if (max_blocks > uf->bpb.fat_size)
+		max_blocks = uf->bpb.fat_size;
+
+	uf->free_summary = counts;
+	uf->free_summary_blocks = max_blocks;
+	uf->free_summary_done = 0;
+}
+
+int ufat_free_summary_step(struct ufat *uf, unsigned int max_blocks)
+{
+	const ufat_cluster_t total = uf->bpb.num_clusters;
+
+	while (max_blocks && uf->free_summary_done < uf->free_summary_blocks) {
+		const unsigned int b = uf->free_summary_done;
+		ufat_cluster_t idx = fat_block_first(uf, b);
+		ufat_cluster_t end = fat_block_first(uf, b + 1);
+		uint16_t count = 0;
+
+		/* Skip first two "special" clusters */
+		if (idx < 2)
+			idx = 2;
+		if (end > total)
+			end = total;
+
+		for (; idx < end; idx++) {
+			ufat_cluster_t c;
+			int err;
+
+			/* Never use this cluster index in a FAT12 system */
+			if (idx == 0xff0 && uf->bpb.type == UFAT_TYPE_FAT12)
+				continue;
+
+			err = ufat_read_fat(uf, idx, &c);
+			if (err < 0)
+				return err;
+
+			if (c == UFAT_CLUSTER_FREE)
+				count++;
+		}
+
+		/* From here on, this block's count is maintained by
+		 * ufat_write_fat().
+		 */
+		uf->free_summary[b] = count;
+		uf->free_summary_done++;
+		max_blocks--;
+	}
+
+	return uf->free_summary_done < uf->free_summary_blocks;
+}
+
+int ufat_free_summary_init(struct ufat *uf, uint16_t *counts,
+			   unsigned int max_blocks)
+{
+	ufat_free_summary_begin(uf, counts, max_blocks);
+	return ufat_free_summary_step(uf, uf->free_summary_blocks);
+}
+
 void ufat_close(struct ufat *uf)
 {
+#ifndef UFAT_READ_ONLY
 	ufat_sync(uf);
+#endif
+	cache_drop(uf);
 }
 
 const char *ufat_strerror(int err)
@@ -383,7 +1404,9 @@ const char *ufat_strerror(int err)
 		[UFAT_ERR_FILE_EXISTS] = "File already exists",
 		[UFAT_ERR_BAD_ENCODING] = "Bad encoding",
 		[UFAT_ERR_DIRECTORY_FULL] = "Directory is full",
-		[UFAT_ERR_NO_CLUSTERS] = "No free clusters"
+		[UFAT_ERR_NO_CLUSTERS] = "No free clusters",
+		[UFAT_ERR_INVALID_LOG] = "Invalid log area",
+		[UFAT_ERR_NOT_MAPPED] = "Device can't be mapped"
 	};
 
 	if (err < 0)
@@ -523,6 +1546,69 @@ int ufat_read_fat(struct ufat *uf, ufat_cluster_t index,
 	return 0;
 }
 
+/* Links which stay within one FAT block are followed without going back to
+ * the cache, so a contiguous file costs one lookup per FAT block rather than
+ * one per cluster. FAT12 entries can straddle blocks, so they're read one at
+ * a time.
+ */
+int ufat_chain_length(struct ufat *uf, ufat_cluster_t start,
+		      ufat_cluster_t *count)
+{
+	const unsigned int shift = uf->dev->log2_block_size -
+		(uf->bpb.type == UFAT_TYPE_FAT32 ? 2 : 1);
+	ufat_cluster_t c = start;
+	ufat_cluster_t n = 0;
+
+	while (UFAT_CLUSTER_IS_PTR(c)) {
+		const unsigned int b = c >> shift;
+		const uint8_t *data;
+		int i;
+
+		if (uf->bpb.type == UFAT_TYPE_FAT12) {
+			i = ufat_read_fat(uf, c, &c);
+			if (i < 0)
+				return i;
+
+			if (++n >= uf->bpb.num_clusters)
+				return -UFAT_ERR_INVALID_CLUSTER;
+
+			continue;
+		}
+
+		if (c >= uf->bpb.num_clusters)
+			return -UFAT_ERR_INVALID_CLUSTER;
+
+		i = ufat_cache_open(uf, uf->bpb.fat_start + b, 0);
+		if (i < 0)
+			return i;
+
+		data = ufat_cache_data(uf, i);
+
+		do {
+			const unsigned int r = c & ((1 << shift) - 1);
+
+			if (uf->bpb.type == UFAT_TYPE_FAT32) {
+				c = r32(data + r * 4) & UFAT_CLUSTER_MASK;
+				if (c >= 0xffffff7)
+					c = UFAT_CLUSTER_EOC;
+			} else {
+				c = r16(data + r * 2);
+				if (c >= 0xfff7)
+					c = UFAT_CLUSTER_EOC;
+			}
+
+			/* A longer chain must have a loop in it */
+			if (++n >= uf->bpb.num_clusters)
+				return -UFAT_ERR_INVALID_CLUSTER;
+		} while (UFAT_CLUSTER_IS_PTR(c) && (c >> shift) == b &&
+			 c < uf->bpb.num_clusters);
+	}
+
+	*count = n;
+	return 0;
+}
+
+#ifndef UFAT_READ_ONLY
 static int write_fat_byte(struct ufat *uf, unsigned int offset,
 			  uint8_t byte, uint8_t mask)
 {
@@ -530,13 +1616,17 @@ static int write_fat_byte(struct ufat *uf, unsigned int offset,
 	unsigned int r = offset & ((1 << uf->dev->log2_block_size) - 1);
 	int idx;
 	uint8_t *data;
+	int err;
 
 	idx = ufat_cache_open(uf, uf->bpb.fat_start + b, 0);
 	if (idx < 0)
 		return idx;
 
+	err = ufat_cache_write(uf, idx);
+	if (err < 0)
+		return err;
+
 	data = ufat_cache_data(uf, idx);
-	ufat_cache_write(uf, idx);
 
 	data[r] = (data[r] & ~mask) | (byte & mask);
 	return 0;
@@ -572,11 +1662,15 @@ static int write_fat16(struct ufat *uf, ufat_cluster_t index,
 	const unsigned int b = index >> shift;
 	const unsigned int r = index & ((1 << shift) - 1);
 	int i = ufat_cache_open(uf, uf->bpb.fat_start + b, 0);
+	int err;
 
 	if (i < 0)
 		return i;
 
-	ufat_cache_write(uf, i);
+	err = ufat_cache_write(uf, i);
+	if (err < 0)
+		return err;
+
 	w16(ufat_cache_data(uf, i) + r * 2, in & 0xffff);
 
 	return 0;
@@ -589,22 +1683,23 @@ static int write_fat32(struct ufat *uf, ufat_cluster_t index,
 	const unsigned int b = index >> shift;
 	const unsigned int r = index & ((1 << shift) - 1);
 	int i = ufat_cache_open(uf, uf->bpb.fat_start + b, 0);
+	int err;
 
 	if (i < 0)
 		return i;
 
-	ufat_cache_write(uf, i);
+	err = ufat_cache_write(uf, i);
+	if (err < 0)
+		return err;
+
 	w32(ufat_cache_data(uf, i) + r * 4, in);
 
 	return 0;
 }
 
-int ufat_write_fat(struct ufat *uf, ufat_cluster_t index,
-		   ufat_cluster_t in)
+static int write_fat_entry(struct ufat *uf, ufat_cluster_t index,
+			   ufat_cluster_t in)
 {
-	if (index >= uf->bpb.num_clusters)
-		return -UFAT_ERR_INVALID_CLUSTER;
-
 	switch (uf->bpb.type) {
 	case UFAT_TYPE_FAT12: return write_fat12(uf, index, in);
 	case UFAT_TYPE_FAT16: return write_fat16(uf, index, in);
@@ -614,6 +1709,39 @@ int ufat_write_fat(struct ufat *uf, ufat_cluster_t index,
 	return 0;
 }
 
+int ufat_write_fat(struct ufat *uf, ufat_cluster_t index,
+		   ufat_cluster_t in)
+{
+	const unsigned int b = fat_entry_block(uf, index);
+	ufat_cluster_t old;
+	int err;
+
+	if (index >= uf->bpb.num_clusters)
+		return -UFAT_ERR_INVALID_CLUSTER;
+
+	if (b >= uf->free_summary_done)
+		return write_fat_entry(uf, index, in);
+
+	/* Keep the free-space summary up to date. The old entry is in a block
+	 * we're about to modify anyway, so this read is almost always a cache
+	 * hit.
+	 */
+	err = ufat_read_fat(uf, index, &old);
+	if (err < 0)
+		return err;
+
+	err = write_fat_entry(uf, index, in);
+	if (err < 0)
+		return err;
+
+	if (old == UFAT_CLUSTER_FREE && in != UFAT_CLUSTER_FREE)
+		uf->free_summary[b]--;
+	else if (old != UFAT_CLUSTER_FREE && in == UFAT_CLUSTER_FREE)
+		uf->free_summary[b]++;
+
+	return 0;
+}
+
 int ufat_free_chain(struct ufat *uf, ufat_cluster_t c)
 {
 	while (UFAT_CLUSTER_IS_PTR(c)) {
@@ -634,16 +1762,35 @@ int ufat_free_chain(struct ufat *uf, ufat_cluster_t c)
 }
 
 static int alloc_cluster(struct ufat *uf, ufat_cluster_t *out,
-			 ufat_cluster_t tail)
+			 ufat_cluster_t tail, ufat_cluster_t hint)
 {
 	const unsigned int total = uf->bpb.num_clusters - 2;
+	const int near = hint >= 2 && hint < uf->bpb.num_clusters;
+	unsigned int ptr = near ? hint - 2 : uf->alloc_ptr;
 	unsigned int i;
 
+	/* If we were given a hint, search forward from it rather than from
+	 * the global allocation pointer. This keeps new clusters close to the
+	 * data they'll be read together with.
+	 */
 	for (i = 0; i < total; i++) {
-		const ufat_cluster_t idx = uf->alloc_ptr + 2;
+		const ufat_cluster_t idx = ptr + 2;
+		const unsigned int b = fat_entry_block(uf, idx);
 		ufat_cluster_t c;
 
-		uf->alloc_ptr = (uf->alloc_ptr + 1) % total;
+		ptr = (ptr + 1) % total;
+
+		/* Skip over FAT blocks known to be full */
+		if (b < uf->free_summary_done && !uf->free_summary[b]) {
+			ufat_cluster_t next = fat_block_first(uf, b + 1);
+
+			if (next > uf->bpb.num_clusters)
+				next = uf->bpb.num_clusters;
+
+			i += next - idx - 1;
+			ptr = (ptr + next - idx - 1) % total;
+			continue;
+		}
 
 		/* Never use this cluster index in a FAT12 system */
 		if (idx == 0xff0 && uf->bpb.type == UFAT_TYPE_FAT12)
@@ -655,6 +1802,9 @@ static int alloc_cluster(struct ufat *uf, ufat_cluster_t *out,
 			if (err < 0)
 				return err;
 
+			if (!near)
+				uf->alloc_ptr = ptr;
+
 			*out = idx;
 			return 0;
 		}
@@ -663,12 +1813,13 @@ static int alloc_cluster(struct ufat *uf, ufat_cluster_t *out,
 	return -UFAT_ERR_NO_CLUSTERS;
 }
 
-int ufat_alloc_chain(struct ufat *uf, unsigned int count, ufat_cluster_t *out)
+int ufat_alloc_chain(struct ufat *uf, unsigned int count, ufat_cluster_t hint,
+		     ufat_cluster_t *out)
 {
 	ufat_cluster_t chain = UFAT_CLUSTER_EOC;
 
 	while (count) {
-		int err = alloc_cluster(uf, &chain, chain);
+		int err = alloc_cluster(uf, &chain, chain, hint);
 
 		if (err < 0) {
 			ufat_free_chain(uf, chain);
@@ -681,3 +1832,4 @@ int ufat_alloc_chain(struct ufat *uf, unsigned int count, ufat_cluster_t *out)
 	*out = chain;
 	return 0;
 }
+#endif
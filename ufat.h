@@ -41,6 +41,12 @@ extern "C"
 {
 #endif	/* def __cplusplus */
 
+/* Define UFAT_READ_ONLY to build without anything which modifies a
+ * filesystem: file and directory writes, cluster allocation, the intent
+ * log, the write-back queue and ufat_mkfs(). The cache then only ever holds
+ * clean blocks, and is never flushed.
+ */
+
 /** Block counts and indices are held in this type. */
 typedef unsigned long long ufat_block_t;
 
@@ -62,25 +68,133 @@ struct ufat_device {
 				ufat_block_t count, void *buffer);
 	/**
 	 * Pointer to function used to write data to block device. Should
-	 * return 0 on success or -1 if an error occurs.
+	 * return 0 on success or -1 if an error occurs. Not used, and may be
+	 * `NULL`, if uFAT is built with `UFAT_READ_ONLY`.
 	 */
 	int		(*write)(const struct ufat_device *dev, ufat_block_t start,
 				ufat_block_t count, const void *buffer);
 };
 
+/**
+ * Function used to map blocks of a device into memory, for devices such as
+ * memory-mapped NOR flash (see `ufat_set_map()`). Should return a pointer to
+ * the given blocks, which are contiguous in memory, or `NULL` if they can't
+ * be mapped.
+ */
+typedef const void *(*ufat_map_t)(const struct ufat_device *dev,
+				  ufat_block_t start, ufat_block_t count);
+
+/** Classes of device request, for use by a dispatcher. */
+typedef enum {
+	/** File data read directly into the caller's buffer */
+	UFAT_IO_READ,
+	/** File data written directly from the caller's buffer */
+	UFAT_IO_WRITE,
+	/** Cache misses, and direct writes of new directory clusters */
+	UFAT_IO_METADATA,
+	/** Dirty cache blocks (and FAT copies) being written back */
+	UFAT_IO_WRITEBACK,
+	/** Blocks read ahead of time into the cache */
+	UFAT_IO_PREFETCH
+} ufat_io_class_t;
+
+/**
+ * An optional dispatcher, which sits between a filesystem and its device
+ * and sees the class of each request (see `ufat_set_dispatch()`). It may
+ * reorder requests, but reads must always return the most recently written
+ * data. Functions return 0 on success or -1 if an error occurs, as device
+ * functions do.
+ */
+
+struct ufat_dispatch {
+	int		(*read)(struct ufat_dispatch *d,
+				const struct ufat_device *dev,
+				ufat_io_class_t cls, ufat_block_t start,
+				ufat_block_t count, void *buffer);
+	int		(*write)(struct ufat_dispatch *d,
+				 const struct ufat_device *dev,
+				 ufat_io_class_t cls, ufat_block_t start,
+				 ufat_block_t count, const void *buffer);
+	/** Complete all deferred requests. Called by ufat_sync(). */
+	int		(*sync)(struct ufat_dispatch *d);
+};
+
+#ifndef UFAT_READ_ONLY
+struct ufat_wbq_entry {
+	const struct ufat_device	*dev;
+	ufat_block_t			index;
+};
+
+/**
+ * A write-back queue. This is a dispatcher which defers write-back of dirty
+ * cache blocks, so that reads don't wait behind them. Other requests are
+ * passed straight through to the device. It may be shared by several
+ * filesystems.
+ */
+
+struct ufat_wbq {
+	struct ufat_dispatch	base;
+
+	unsigned int		log2_block_size;
+	unsigned int		capacity;
+	unsigned int		head;
+	unsigned int		count;
+
+	struct ufat_wbq_entry	*ent;
+	uint8_t			*data;
+};
+#endif
+
 /* Cache parameters. The more cache is used, the fewer filesystem reads/writes
  * have to be performed. The cache must be able to hold at least one block.
+ *
+ * These set the size of the cache embedded in each struct ufat. Define
+ * UFAT_NO_LOCAL_CACHE to leave it out, if all filesystems are opened with
+ * ufat_open_shared() instead.
  */
 #define UFAT_CACHE_MAX_BLOCKS		16
 #define UFAT_CACHE_BYTES		8192
 
+#ifndef UFAT_READ_ONLY
+/* New directory clusters are cleared from a constant run of zeroes of this
+ * size. A cluster of up to this size plus one block is cleared with a single
+ * write request. Larger clusters take one request per run.
+ */
+#ifndef UFAT_ZERO_RUN_BYTES
+#define UFAT_ZERO_RUN_BYTES		4096
+#endif
+#endif
+
+#ifndef UFAT_READ_ONLY
 #define UFAT_CACHE_FLAG_DIRTY		0x01
+#endif
 #define UFAT_CACHE_FLAG_PRESENT		0x02
 
+struct ufat;
+
 struct ufat_cache_desc {
 	int		flags;
 	unsigned int	seq;
+#ifndef UFAT_READ_ONLY
+	unsigned int	epoch;
+#endif
 	ufat_block_t	index;
+	struct ufat	*owner;
+};
+
+/**
+ * A block cache. Each filesystem normally has its own, but one cache can
+ * also be shared by several filesystems on devices with the same block size,
+ * so that memory goes to whichever of them is busy.
+ */
+
+struct ufat_cache {
+	unsigned int		log2_block_size;
+	unsigned int		size;
+	unsigned int		next_seq;
+
+	struct ufat_cache_desc	*desc;
+	uint8_t			*data;
 };
 
 /** Performance accounting statistics. */
@@ -129,19 +243,55 @@ struct ufat_bpb {
 	ufat_cluster_t		root_cluster;
 };
 
-/** This structure holds the data for an open filesystem. */
+/** This structure holds the data for an open filesystem. When opened with
+ * ufat_open(), it points into itself (at its own cache), so it must not be
+ * copied or moved until it's closed.
+ */
 struct ufat {
 	const struct ufat_device	*dev;
 
 	struct ufat_stat		stat;
 	struct ufat_bpb			bpb;
 
-	unsigned int			next_seq;
-	unsigned int			cache_size;
+	struct ufat_cache		*cache;
+	struct ufat_dispatch		*dispatch;
+	ufat_map_t			map;
+	unsigned int			log2_cache_line;
+
+#ifndef UFAT_READ_ONLY
 	ufat_cluster_t			alloc_ptr;
 
+	/* Write-back ordering. Blocks dirtied in one epoch reach the disk
+	 * before any dirtied in a later one. dirty_epoch is the epoch of the
+	 * most recently dirtied block.
+	 */
+	unsigned int			epoch;
+	unsigned int			dirty_epoch;
+#endif
+
+	/* Optional free-space summary: one count of free entries per FAT
+	 * block, for the first free_summary_blocks blocks of the FAT. Only
+	 * the first free_summary_done counts have been built so far.
+	 */
+	uint16_t			*free_summary;
+	unsigned int			free_summary_blocks;
+	unsigned int			free_summary_done;
+
+#ifndef UFAT_READ_ONLY
+	/* Optional intent log (see ufat_log_attach()). The log is attached
+	 * if log_count is non-zero.
+	 */
+	ufat_block_t			log_start;
+	unsigned int			log_count;
+	unsigned int			log_seq;
+	uint8_t				*log_buf;
+#endif
+
+#ifndef UFAT_NO_LOCAL_CACHE
+	struct ufat_cache		local_cache;
 	struct ufat_cache_desc		cache_desc[UFAT_CACHE_MAX_BLOCKS];
 	uint8_t				cache_data[UFAT_CACHE_BYTES];
+#endif
 };
 
 /** Error codes. */
@@ -162,6 +312,8 @@ typedef enum {
 	UFAT_ERR_BAD_ENCODING,
 	UFAT_ERR_DIRECTORY_FULL,
 	UFAT_ERR_NO_CLUSTERS,
+	UFAT_ERR_INVALID_LOG,
+	UFAT_ERR_NOT_MAPPED,
 	UFAT_MAX_ERR
 } ufat_error_t;
 
@@ -181,6 +333,9 @@ const char *ufat_strerror(int err);
  * \pre Both `uf` and `dev` are valid pointers, they must remain valid until the
  * filesystem is closed.
  * \pre The filesystem pointed by `uf` is not opened.
+ * \post `*uf` uses its own cache, and must stay at the same address until
+ * it's closed. Copying or moving it leaves the copy using the original's
+ * cache.
  *
  * \param [out] uf is a pointer to a variable into which the filesystem will
  * be opened
@@ -189,7 +344,205 @@ const char *ufat_strerror(int err);
  * \return 0 on success, negative error code (`ufat_error_t`) otherwise
  */
 
+#ifndef UFAT_NO_LOCAL_CACHE
 int ufat_open(struct ufat *uf, const struct ufat_device *dev);
+#endif
+
+/**
+ * \brief Initializes a cache which can be shared by several filesystems.
+ *
+ * \pre `c`, `desc` and `data` are valid pointers, they must remain valid until
+ * all filesystems using the cache are closed.
+ *
+ * \param [out] c is a pointer to the cache
+ * \param [in] log2_block_size is the base-2 logarithm of the block size of
+ * all devices which will use the cache
+ * \param [out] desc is a pointer to an array of `blocks` descriptors
+ * \param [out] data is a pointer to a buffer of `blocks << log2_block_size`
+ * bytes
+ * \param [in] blocks is the number of blocks the cache can hold
+ */
+
+void ufat_cache_init(struct ufat_cache *c, unsigned int log2_block_size,
+		     struct ufat_cache_desc *desc, uint8_t *data,
+		     unsigned int blocks);
+
+/**
+ * \brief Opens the filesystem, using a shared cache.
+ *
+ * This is the same as `ufat_open()`, except that blocks are cached in `cache`
+ * rather than in `uf` itself. Any number of filesystems may be opened on the
+ * same cache. Its blocks are replaced least-recently-used first, regardless
+ * of which filesystem they belong to, and dirty blocks are always written
+ * back to their own device.
+ *
+ * Filesystems sharing a cache must be used from one thread at a time.
+ *
+ * \pre `uf`, `dev` and `cache` are valid pointers, they must remain valid
+ * until the filesystem is closed.
+ * \pre The filesystem pointed by `uf` is not opened.
+ * \pre `cache` has been initialized with `ufat_cache_init()`.
+ *
+ * \param [out] uf is a pointer to a variable into which the filesystem will
+ * be opened
+ * \param [in] dev is a pointer to a block device
+ * \param [in] cache is a pointer to the shared cache
+ *
+ * \return 0 on success, negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_open_shared(struct ufat *uf, const struct ufat_device *dev,
+		     struct ufat_cache *cache);
+
+/**
+ * \brief Sets the size of cache lines.
+ *
+ * By default, the cache is filled one block at a time. With a larger line
+ * size, a cache miss reads the whole aligned line containing the block with
+ * a single request, which helps on devices with small blocks and large
+ * clusters. Dirty blocks are still tracked and written back individually.
+ *
+ * \pre `uf` is a valid pointer.
+ * \pre The filesystem pointed by `uf` is opened.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [in] log2_blocks is the base-2 logarithm of the line size, in blocks.
+ * At least two lines must fit in the cache. 0 restores the default.
+ *
+ * \return 0 on success, negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_set_cache_line(struct ufat *uf, unsigned int log2_blocks);
+
+/**
+ * \brief Reads filesystem metadata into the cache ahead of time.
+ *
+ * This is intended to be called just after `ufat_open()`. The first blocks of
+ * the FAT and the root directory (the fixed root region on FAT12/16, or the
+ * first root cluster on FAT32) are read using a few multi-block reads, as far
+ * as free cache space allows, rather than one block at a time on demand.
+ *
+ * \pre `uf` is a valid pointer.
+ * \pre The filesystem pointed by `uf` is opened.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ *
+ * \return 0 on success, negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_prefetch_metadata(struct ufat *uf);
+
+/**
+ * \brief Lists the blocks currently held in the cache.
+ *
+ * The list is ordered from most to least recently used. It can be saved and
+ * passed to `ufat_cache_warm()` after the next `ufat_open()`, so that a newly
+ * mounted filesystem starts with the blocks which were hot before.
+ *
+ * \pre Both `uf` and `list` are valid pointers.
+ * \pre The filesystem pointed by `uf` is opened.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [out] list is a pointer to an array into which block indices will
+ * be written
+ * \param [in] max is the number of elements in `list`
+ *
+ * \return number of block indices written to `list`
+ */
+
+unsigned int ufat_cache_export(const struct ufat *uf, ufat_block_t *list,
+			       unsigned int max);
+
+/**
+ * \brief Reads a list of blocks into the cache.
+ *
+ * The list is sorted in place and runs of adjacent blocks are read with
+ * multi-block reads. Only free cache slots are used, and blocks outside the
+ * filesystem are ignored, so a stale list is harmless.
+ *
+ * \pre Both `uf` and `list` are valid pointers.
+ * \pre The filesystem pointed by `uf` is opened.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [in,out] list is a pointer to an array of block indices, as produced
+ * by `ufat_cache_export()`
+ * \param [in] count is the number of elements in `list`
+ *
+ * \return 0 on success, negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_cache_warm(struct ufat *uf, ufat_block_t *list, unsigned int count);
+
+/**
+ * \brief Routes device requests through a dispatcher.
+ *
+ * \pre `uf` is a valid pointer. `d` is a valid pointer which must remain
+ * valid until the filesystem is closed, or NULL to remove the dispatcher.
+ * \pre The filesystem pointed by `uf` is opened.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [in] d is a pointer to the dispatcher
+ */
+
+void ufat_set_dispatch(struct ufat *uf, struct ufat_dispatch *d);
+
+/**
+ * \brief Reads file data directly from a mapping of the device.
+ *
+ * With a mapping function set, file data is read straight from the mapping,
+ * without going through the cache, and `ufat_file_map()` can be used. There
+ * is no mapping until this is called. It isn't used while a dispatcher is
+ * set, since the dispatcher may hold newer copies of blocks.
+ *
+ * \pre `uf` is a valid pointer.
+ * \pre The filesystem pointed by `uf` is opened.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [in] map is a pointer to the mapping function, or NULL to stop
+ * using the mapping
+ */
+
+void ufat_set_map(struct ufat *uf, ufat_map_t map);
+
+#ifndef UFAT_READ_ONLY
+/**
+ * \brief Initializes a write-back queue.
+ *
+ * The queue is used by passing `&q->base` to `ufat_set_dispatch()`. Queued
+ * blocks are written to their devices in order when the queue fills up,
+ * when `ufat_wbq_drain()` is called, and on `ufat_sync()`.
+ *
+ * \pre `q`, `ent` and `data` are valid pointers, they must remain valid while
+ * the queue is in use.
+ *
+ * \param [out] q is a pointer to the queue
+ * \param [in] log2_block_size is the base-2 logarithm of the block size of
+ * all devices which will use the queue
+ * \param [out] ent is a pointer to an array of `capacity` entries
+ * \param [out] data is a pointer to a buffer of `capacity << log2_block_size`
+ * bytes
+ * \param [in] capacity is the number of blocks the queue can hold
+ */
+
+void ufat_wbq_init(struct ufat_wbq *q, unsigned int log2_block_size,
+		   struct ufat_wbq_entry *ent, uint8_t *data,
+		   unsigned int capacity);
+
+/**
+ * \brief Writes queued blocks to their devices.
+ *
+ * Runs of consecutive blocks are written with multi-block writes.
+ *
+ * \pre `q` is a valid pointer.
+ *
+ * \param [in] q is a pointer to the queue
+ * \param [in] max_blocks is the maximum number of blocks to write
+ *
+ * \return 0 if the queue is empty, 1 if blocks remain, negative error code
+ * (`ufat_error_t`) otherwise
+ */
+
+int ufat_wbq_drain(struct ufat_wbq *q, unsigned int max_blocks);
 
 /**
  * \brief Synchronizes the filesystem by flushing cache.
@@ -204,6 +557,76 @@ int ufat_open(struct ufat *uf, const struct ufat_device *dev);
 
 int ufat_sync(struct ufat *uf);
 
+/**
+ * \brief Synchronizes part of the filesystem.
+ *
+ * Dirty blocks are flushed oldest first, with adjacent blocks combined into
+ * multi-block writes, until `max_blocks` blocks have been written. This
+ * allows the cost of `ufat_sync()` to be spread over several calls, for
+ * example from an idle loop with a fixed time budget. FAT blocks are also
+ * written to the other copies of the FAT, which isn't counted in the
+ * budget.
+ *
+ * With an intent log attached (see `ufat_log_attach()`), the budget limits
+ * the number of blocks committed through the log. Each of those blocks is
+ * also written to the log, and each batch writes the log header twice,
+ * none of which is counted either.
+ *
+ * \pre `uf` is a valid pointer.
+ * \pre The filesystem pointed by `uf` is opened.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [in] max_blocks is the maximum number of blocks to write
+ *
+ * \return 0 if no dirty blocks remain, 1 if more remain to be flushed,
+ * negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_sync_step(struct ufat *uf, unsigned int max_blocks);
+
+/**
+ * \brief Attaches an intent log.
+ *
+ * With a log attached, dirty blocks are never written straight back to the
+ * filesystem. They are first copied to the log area and committed, and only
+ * then written to their home locations, so that every batch of metadata
+ * updates (for example, allocating a cluster, linking it into a chain and
+ * updating a directory entry) reaches the filesystem as a whole or not at
+ * all. A batch holds as many blocks as the log area does, minus one for the
+ * header (and at most `(block size - 20) / 8`). `ufat_sync_step()` commits
+ * batches of no more than its budget.
+ *
+ * Updates which don't fit in one batch are split in the order given by
+ * cache barriers. An interruption between batches can then leave clusters
+ * allocated but unreferenced, but not referenced and free.
+ *
+ * If the log holds a committed batch which wasn't completely written home
+ * (because of power loss, for example), it's replayed when the log is
+ * attached. The log should therefore be attached just after opening the
+ * filesystem, before anything else (such as `ufat_free_summary_init()`)
+ * reads the FAT.
+ *
+ * The log area must lie within the reserved blocks between the boot sector
+ * and the first FAT, and must not overlap the FSInfo or backup boot sectors
+ * of FAT32 filesystems.
+ *
+ * \pre Both `uf` and `buf` are valid pointers, `buf` must remain valid until
+ * the filesystem is closed.
+ * \pre The filesystem pointed by `uf` is opened.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [in] start is the first block of the log area
+ * \param [in] count is the number of blocks in the log area (at least 2)
+ * \param [out] buf is a pointer to a buffer of one block, used for the log
+ * header
+ *
+ * \return 0 on success, negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_log_attach(struct ufat *uf, ufat_block_t start, unsigned int count,
+		    uint8_t *buf);
+#endif
+
 /**
  * \brief Count number of free clusters.
  *
@@ -224,9 +647,75 @@ int ufat_sync(struct ufat *uf);
 
 int ufat_count_free_clusters(struct ufat *uf, ufat_cluster_t *free_clusters);
 
+/**
+ * \brief Builds a free-space summary for faster allocation.
+ *
+ * The summary holds the number of free entries in each block of the FAT.
+ * Once built, it's kept up to date as the FAT is modified, and allows
+ * cluster allocation and `ufat_count_free_clusters()` to skip FAT blocks
+ * which have no free entries without reading them.
+ *
+ * One counter is required per FAT block (`uf->bpb.fat_size`). If fewer are
+ * supplied, only the start of the FAT is summarized. The whole FAT is read
+ * once to build the summary. See `ufat_free_summary_begin()` for a way to
+ * build it incrementally instead.
+ *
+ * \pre Both `uf` and `counts` are valid pointers, `counts` must remain valid
+ * until the filesystem is closed.
+ * \pre The filesystem pointed by `uf` is opened.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [out] counts is a pointer to an array of counters
+ * \param [in] max_blocks is the number of elements in `counts`
+ *
+ * \return 0 on success, negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_free_summary_init(struct ufat *uf, uint16_t *counts,
+			   unsigned int max_blocks);
+
+/**
+ * \brief Starts building a free-space summary incrementally.
+ *
+ * This is the same as `ufat_free_summary_init()`, except that no FAT blocks
+ * are read. The summary must then be built by calling
+ * `ufat_free_summary_step()` (for example, from an idle loop) until it
+ * reports completion. Until then, allocation probes the FAT as usual for
+ * the blocks which haven't yet been summarized, and benefits from the ones
+ * which have.
+ *
+ * \pre Both `uf` and `counts` are valid pointers, `counts` must remain valid
+ * until the filesystem is closed.
+ * \pre The filesystem pointed by `uf` is opened.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [out] counts is a pointer to an array of counters
+ * \param [in] max_blocks is the number of elements in `counts`
+ */
+
+void ufat_free_summary_begin(struct ufat *uf, uint16_t *counts,
+			     unsigned int max_blocks);
+
+/**
+ * \brief Continues building a free-space summary.
+ *
+ * \pre `uf` is a valid pointer.
+ * \pre The filesystem pointed by `uf` is opened.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [in] max_blocks is the maximum number of FAT blocks to scan
+ *
+ * \return 0 if the summary is complete, 1 if more blocks remain to be
+ * scanned, negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_free_summary_step(struct ufat *uf, unsigned int max_blocks);
+
 /**
  * \brief Closes filesystem.
  *
+ * The cache is flushed, and the filesystem's blocks are removed from it.
+ *
  * \pre `uf` is a valid pointer.
  * \pre The filesystem pointed by `uf` is opened.
  *
@@ -295,6 +784,11 @@ struct ufat_directory {
 #define UFAT_LFN_MAX_CHARS	255
 #define UFAT_LFN_MAX_UTF8	768
 
+/* Directory levels tracked on the stack by tree walks */
+#ifndef UFAT_TREE_DEPTH
+#define UFAT_TREE_DEPTH		8
+#endif
+
 /**
  * \brief Opens root directory.
  *
@@ -364,6 +858,47 @@ void ufat_dir_rewind(struct ufat_directory *dir);
 int ufat_dir_read(struct ufat_directory *dir, struct ufat_dirent *inf,
 		  char *name_buf, int max_len);
 
+/* Space used by a directory tree */
+struct ufat_usage {
+	unsigned int		files;
+	unsigned int		directories;
+
+	/* Sum of file sizes */
+	unsigned long long	logical_bytes;
+
+	/* Clusters allocated to files, and to directories (including the
+	 * top directory, unless it's a FAT12/16 root directory)
+	 */
+	ufat_cluster_t		file_clusters;
+	ufat_cluster_t		dir_clusters;
+};
+
+/**
+ * \brief Measures the space used by a file or directory tree.
+ *
+ * The tree is walked once. Allocated space is found by following the
+ * cluster chain of every file and directory in the FAT, so it includes
+ * clusters beyond the end of a file's data, and the clusters of
+ * directories. The walk uses the same frame stack as
+ * `ufat_remove_tree()`.
+ *
+ * \pre Both `uf` and `u` are valid pointers.
+ * \pre The filesystem pointed by `uf` is opened.
+ * \pre If not NULL, directory entry pointed by `ent` is a result of a
+ * successful create/find/move/read operation.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [in] ent is a pointer to a directory entry representing the
+ * file/directory to measure, or NULL for the root directory
+ * \param [out] u is a pointer to a structure which will be filled out
+ *
+ * \return 0 on success, negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_tree_usage(struct ufat *uf, const struct ufat_dirent *ent,
+		    struct ufat_usage *u);
+
+#ifndef UFAT_READ_ONLY
 /**
  * \brief Deletes file or directory.
  *
@@ -381,6 +916,35 @@ int ufat_dir_read(struct ufat_directory *dir, struct ufat_dirent *inf,
 
 int ufat_dir_delete(struct ufat *uf, struct ufat_dirent *ent);
 
+/**
+ * \brief Deletes a file, or a directory and everything in it.
+ *
+ * The entry is removed from its parent first, and then the clusters of
+ * every file and directory inside it are freed. Nothing inside the tree is
+ * written to, and no directory is checked for emptiness, so this is much
+ * cheaper than deleting each entry with `ufat_dir_delete()`. If interrupted
+ * after the first step, the remaining clusters are lost until the
+ * filesystem is checked.
+ *
+ * Up to `UFAT_TREE_DEPTH` levels of the walk are tracked on the stack.
+ * Deeper directories are still removed, but returning from each of them
+ * means finding its parent from its ".." entry and searching the parent
+ * again.
+ *
+ * \pre Both `uf` and `ent` are valid pointers.
+ * \pre The filesystem pointed by `uf` is opened.
+ * \pre Directory entry pointed by `ent` is a result of a successful
+ * create/find/move/read operation.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [in] ent is a pointer to a directory entry representing the
+ * file/directory which will be deleted
+ *
+ * \return 0 on success, negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_remove_tree(struct ufat *uf, struct ufat_dirent *ent);
+
 /**
  * \brief Creates a directory.
  *
@@ -398,6 +962,34 @@ int ufat_dir_delete(struct ufat *uf, struct ufat_dirent *ent);
 int ufat_dir_create(struct ufat_directory *dir, struct ufat_dirent *ent,
 		    const char *name);
 
+/**
+ * \brief Creates a directory and any missing parents, like `mkdir -p`.
+ *
+ * The path is resolved once, relative to `dir`. Below the last existing
+ * directory, each new directory is created empty with its entry written
+ * straight into its new parent, without searching for duplicate long or
+ * short names. The first new directory is linked into the existing tree
+ * last, so the new path appears all at once.
+ *
+ * It isn't an error for the whole path to exist already, provided that it
+ * names a directory.
+ *
+ * \pre `dir`, `ent` and `path` are valid pointers.
+ * \pre The directory pointed by `dir` is opened.
+ *
+ * \param [in,out] dir is a pointer to a directory, which is reinitialized
+ * to be an iterator for the parent of the last directory in the path
+ * \param [in,out] ent is a pointer to a directory entry whose attributes
+ * and dates are used for new directories, and into which the entry of the
+ * last directory in the path will be written
+ * \param [in] path is the path of the directory to create
+ *
+ * \return 0 on success, negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_dir_create_path(struct ufat_directory *dir, struct ufat_dirent *ent,
+			 const char *path);
+
 /**
  * \brief Creates a file.
  *
@@ -414,6 +1006,7 @@ int ufat_dir_create(struct ufat_directory *dir, struct ufat_dirent *ent,
 
 int ufat_dir_mkfile(struct ufat_directory *dir, struct ufat_dirent *ent,
 		    const char *name);
+#endif
 
 /**
  * \brief Searches for an entry by name in given directory.
@@ -475,6 +1068,7 @@ int ufat_dir_find_path(struct ufat_directory *dir, const char *path,
 int ufat_get_filename(struct ufat *uf, const struct ufat_dirent *ent,
 		      char *name_buf, int max_len);
 
+#ifndef UFAT_READ_ONLY
 /**
  * \brief Alters the dates, times and attributes of a directory entry.
  *
@@ -511,8 +1105,15 @@ int ufat_update_attributes(struct ufat *uf, struct ufat_dirent *ent);
 
 int ufat_move(struct ufat_dirent *ent, struct ufat_directory *dst,
 	      const char *new_name);
+#endif
 
 /* File IO */
+typedef enum {
+	UFAT_FILE_OP_NONE = 0,
+	UFAT_FILE_OP_READ,
+	UFAT_FILE_OP_WRITE
+} ufat_file_op_t;
+
 struct ufat_file {
 	struct ufat		*uf;
 
@@ -526,6 +1127,15 @@ struct ufat_file {
 
 	ufat_cluster_t		cur_cluster;
 	ufat_size_t		cur_pos;
+
+	/* Resumable operation in progress (see ufat_file_step()) */
+	ufat_file_op_t		op;
+	char			*op_read_buf;
+#ifndef UFAT_READ_ONLY
+	const char		*op_write_buf;
+#endif
+	ufat_size_t		op_remaining;
+	ufat_size_t		op_done;
 };
 
 /**
@@ -554,6 +1164,8 @@ int ufat_open_file(struct ufat *uf, struct ufat_file *f,
  * \pre File pointed by `f` is opened.
  *
  * \post Position of file pointed by `f` is rewound.
+ * \post Any resumable operation in progress is abandoned. An abandoned
+ * write doesn't update the file size.
  *
  * \param [in] f is a pointer to a file
  */
@@ -575,6 +1187,24 @@ void ufat_file_rewind(struct ufat_file *f);
 
 int ufat_file_advance(struct ufat_file *f, ufat_size_t nbytes);
 
+/**
+ * \brief Sets file position.
+ *
+ * Moving within the current cluster costs nothing, and moving forward
+ * follows only the clusters in between. Moving back to an earlier cluster
+ * follows the chain from the start of the file.
+ *
+ * \pre `f` is a valid pointer.
+ * \pre File pointed by `f` is opened.
+ *
+ * \param [in] f is a pointer to a file
+ * \param [in] pos is the new position, which is limited to the file size
+ *
+ * \return 0 on success, negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_file_seek(struct ufat_file *f, ufat_size_t pos);
+
 /**
  * \brief Reads data from file.
  *
@@ -591,6 +1221,32 @@ int ufat_file_advance(struct ufat_file *f, ufat_size_t nbytes);
 
 int ufat_file_read(struct ufat_file *f, void *buf, ufat_size_t max_size);
 
+/**
+ * \brief Maps data from file, without copying it.
+ *
+ * This returns a pointer to the data at the current file position, on a
+ * device which can be mapped into memory (see `ufat_set_map()`), and
+ * advances the position past it. The mapped extent ends where the file's clusters stop being
+ * contiguous, so large files which are stored in order can be mapped in a
+ * single call.
+ *
+ * \pre Both `f` and `ptr` are valid pointers.
+ * \pre File pointed by `f` is opened.
+ *
+ * \param [in] f is a pointer to a file
+ * \param [out] ptr is a pointer to a variable into which a pointer to the
+ * data will be stored
+ * \param [in] max_size is the largest number of bytes to map
+ *
+ * \return number of mapped bytes on success (0 at the end of the file),
+ * `-UFAT_ERR_NOT_MAPPED` if the data can't be mapped, or another
+ * negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_file_map(struct ufat_file *f, const void **ptr,
+		  ufat_size_t max_size);
+
+#ifndef UFAT_READ_ONLY
 /**
  * \brief Writes data to file.
  *
@@ -606,7 +1262,72 @@ int ufat_file_read(struct ufat_file *f, void *buf, ufat_size_t max_size);
  */
 
 int ufat_file_write(struct ufat_file *f, const void *buf, ufat_size_t len);
+#endif
+
+/**
+ * \brief Starts a resumable read.
+ *
+ * No data is transferred until `ufat_file_step()` is called. Only one
+ * operation, resumable or not, may be in progress on a file at a time.
+ *
+ * \pre Both `f` and `buf` are valid pointers, `buf` must remain valid until
+ * the operation completes.
+ * \pre File pointed by `f` is opened.
+ *
+ * \param [in] f is a pointer to a file
+ * \param [out] buf is a pointer to a buffer into which the data will be read
+ * \param [in] max_size is the number of bytes to read
+ */
+
+void ufat_file_read_begin(struct ufat_file *f, void *buf, ufat_size_t max_size);
+
+#ifndef UFAT_READ_ONLY
+/**
+ * \brief Starts a resumable write.
+ *
+ * No data is transferred until `ufat_file_step()` is called. Only one
+ * operation, resumable or not, may be in progress on a file at a time.
+ *
+ * \pre Both `f` and `buf` are valid pointers, `buf` must remain valid until
+ * the operation completes.
+ * \pre File pointed by `f` is opened.
+ *
+ * \param [in] f is a pointer to a file
+ * \param [in] buf is a pointer to a buffer with data that will be written
+ * \param [in] len is the number of bytes to write
+ */
+
+void ufat_file_write_begin(struct ufat_file *f, const void *buf,
+			   ufat_size_t len);
+#endif
 
+/**
+ * \brief Advances a resumable read or write.
+ *
+ * Data is transferred a block fragment or a run of whole blocks at a time,
+ * until the operation completes or at least `max_requests` device requests
+ * have been made. The number of bytes transferred so far is held in
+ * `f->op_done`.
+ *
+ * The budget is checked between steps, so it's a soft limit. A call may
+ * go over it by the requests of one step: the transfer itself, plus any
+ * cache misses and write-backs of dirty blocks while following the
+ * cluster chain, and (for a write) while allocating the next cluster.
+ * The call that completes a write also updates the directory entry.
+ *
+ * \pre `f` is a valid pointer.
+ * \pre File pointed by `f` is opened.
+ *
+ * \param [in] f is a pointer to a file
+ * \param [in] max_requests is the device request budget for this call
+ *
+ * \return 0 if the operation is complete, 1 if it's still in progress,
+ * negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_file_step(struct ufat_file *f, unsigned int max_requests);
+
+#ifndef UFAT_READ_ONLY
 /**
  * \brief Truncates file.
  *
@@ -632,6 +1353,7 @@ int ufat_file_truncate(struct ufat_file *f);
  */
 
 int ufat_mkfs(struct ufat_device *dev, ufat_block_t nblk);
+#endif
 
 #ifdef __cplusplus
 }	/* extern "C" */
@@ -0,0 +1,418 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* C++17 interface.
+ *
+ * This is a thin header-only layer over the C interface. It doesn't
+ * allocate memory or throw exceptions: functions return 0 or a byte count
+ * on success, and a negative error code (`ufat_error_t`) otherwise, as the
+ * C functions do. The underlying C objects are available through `get()`.
+ */
+
+#ifndef UFAT_HPP_
+#define UFAT_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string_view>
+#include <type_traits>
+#include "ufat.h"
+
+namespace ufatpp {
+
+/**
+ * A contiguous range of bytes. It can be made from a pointer and a length,
+ * or from any container with `data()` and `size()` (such as `std::array`,
+ * `std::vector`, `std::string` or `std::span`) holding one-byte elements.
+ */
+
+template <typename T>
+class basic_byte_span {
+public:
+	constexpr basic_byte_span() noexcept = default;
+	constexpr basic_byte_span(T *data, std::size_t size) noexcept :
+		data_(data), size_(size) { }
+
+	template <typename C, typename = std::enable_if_t<
+		  sizeof(*std::data(std::declval<C &>())) == 1 &&
+		  std::is_convertible_v<
+			  decltype(std::data(std::declval<C &>())), T *> > >
+	constexpr basic_byte_span(C &c) noexcept :
+		data_(std::data(c)), size_(std::size(c)) { }
+
+	constexpr T *data() const noexcept { return data_; }
+	constexpr std::size_t size() const noexcept { return size_; }
+
+private:
+	T		*data_ = nullptr;
+	std::size_t	size_ = 0;
+};
+
+using byte_span = basic_byte_span<char>;
+using const_byte_span = basic_byte_span<const char>;
+
+class directory;
+
+/**
+ * An open filesystem. The volume holds its own cache, and is closed when
+ * destroyed. Since the C filesystem object is referred to from its cache,
+ * a volume can be neither copied nor moved.
+ */
+
+class volume {
+public:
+	volume() noexcept = default;
+	~volume() { close(); }
+
+	volume(const volume &) = delete;
+	volume &operator=(const volume &) = delete;
+
+#ifndef UFAT_NO_LOCAL_CACHE
+	/** Opens a device (see `ufat_open()`). */
+	int open(const ufat_device &dev) noexcept
+	{
+		close();
+
+		const int err = ufat_open(&uf_, &dev);
+
+		open_ = !err;
+		return err;
+	}
+#endif
+
+	/** Opens a device using a shared cache (see `ufat_open_shared()`). */
+	int open(const ufat_device &dev, ufat_cache &cache) noexcept
+	{
+		close();
+
+		const int err = ufat_open_shared(&uf_, &dev, &cache);
+
+		open_ = !err;
+		return err;
+	}
+
+	/** Closes the volume, flushing the cache. Does nothing if closed. */
+	void close() noexcept
+	{
+		if (open_)
+			ufat_close(&uf_);
+
+		open_ = false;
+	}
+
+	bool is_open() const noexcept { return open_; }
+
+#ifndef UFAT_READ_ONLY
+	int sync() noexcept { return ufat_sync(&uf_); }
+#endif
+
+	/** Returns an iterator for the root directory. */
+	directory root() noexcept;
+
+	struct ufat *get() noexcept { return &uf_; }
+	const struct ufat *get() const noexcept { return &uf_; }
+
+private:
+	struct ufat	uf_;
+	bool		open_ = false;
+};
+
+/** A directory entry, as yielded by `directory_range`. */
+struct entry {
+	ufat_dirent		info;
+
+	/**
+	 * The long name (or short name, if there isn't one) as UTF-8. This
+	 * refers to a buffer owned by the range, and is only valid until the
+	 * iterator is advanced.
+	 */
+	std::string_view	name;
+
+	bool is_directory() const noexcept
+	{
+		return info.attributes & UFAT_ATTR_DIRECTORY;
+	}
+};
+
+/**
+ * A single pass over the entries of a directory, for use with range-based
+ * for. Each entry's name is decoded into a buffer held by the range, so
+ * that iteration never allocates. Iteration stops early if an error
+ * occurs, in which case `error()` returns it.
+ */
+
+class directory_range {
+public:
+	class iterator {
+	public:
+		using iterator_category = std::input_iterator_tag;
+		using value_type = entry;
+		using difference_type = std::ptrdiff_t;
+		using pointer = const entry *;
+		using reference = const entry &;
+
+		iterator() noexcept = default;
+
+		reference operator*() const noexcept { return r_->cur_; }
+		pointer operator->() const noexcept { return &r_->cur_; }
+
+		iterator &operator++() noexcept
+		{
+			if (!r_->next())
+				r_ = nullptr;
+
+			return *this;
+		}
+
+		bool operator==(const iterator &o) const noexcept
+		{
+			return r_ == o.r_;
+		}
+
+		bool operator!=(const iterator &o) const noexcept
+		{
+			return r_ != o.r_;
+		}
+
+	private:
+		friend class directory_range;
+
+		explicit iterator(directory_range *r) noexcept : r_(r) { }
+
+		directory_range		*r_ = nullptr;
+	};
+
+	explicit directory_range(const ufat_directory &dir) noexcept :
+		dir_(dir)
+	{
+		ufat_dir_rewind(&dir_);
+	}
+
+	/* The iterators point back into the range */
+	directory_range(const directory_range &) = delete;
+	directory_range &operator=(const directory_range &) = delete;
+
+	iterator begin() noexcept
+	{
+		return iterator(next() ? this : nullptr);
+	}
+
+	iterator end() noexcept { return iterator(); }
+
+	/** Returns the error which ended iteration, if any, or 0. */
+	int error() const noexcept { return err_; }
+
+private:
+	bool next() noexcept
+	{
+		const int err = ufat_dir_read(&dir_, &cur_.info,
+					      name_, sizeof(name_));
+
+		if (err) {
+			err_ = err < 0 ? err : 0;
+			return false;
+		}
+
+		cur_.name = name_;
+		return true;
+	}
+
+	ufat_directory		dir_;
+	entry			cur_;
+	int			err_ = 0;
+	char			name_[UFAT_LFN_MAX_UTF8];
+};
+
+/**
+ * A directory. This is a plain value which refers to its volume, and must
+ * not outlive it.
+ */
+
+class directory {
+public:
+	directory() noexcept = default;
+	explicit directory(const ufat_directory &dir) noexcept : dir_(dir) { }
+
+	/** Opens a subdirectory (see `ufat_open_subdir()`). */
+	static int open(volume &v, const ufat_dirent &ent,
+			directory &out) noexcept
+	{
+		return ufat_open_subdir(v.get(), &out.dir_, &ent);
+	}
+
+	/** Returns a range over the entries of the directory. */
+	directory_range entries() const noexcept
+	{
+		return directory_range(dir_);
+	}
+
+	/**
+	 * Finds an entry by name. Returns 0 if found, 1 if not, or a negative
+	 * error code.
+	 */
+	int find(const char *name, ufat_dirent &out) noexcept
+	{
+		return ufat_dir_find(&dir_, name, &out);
+	}
+
+	/**
+	 * Finds an entry by path, relative to this directory. Returns 0 if
+	 * found, 1 if not, or a negative error code.
+	 */
+	int find_path(const char *path, ufat_dirent &out) noexcept
+	{
+		return ufat_dir_find_path(&dir_, path, &out, nullptr);
+	}
+
+#ifndef UFAT_READ_ONLY
+	/** Creates a subdirectory (see `ufat_dir_create()`). */
+	int create_directory(const char *name, ufat_dirent &out) noexcept
+	{
+		return ufat_dir_create(&dir_, &out, name);
+	}
+
+	/** Creates an empty file (see `ufat_dir_mkfile()`). */
+	int create_file(const char *name, ufat_dirent &out) noexcept
+	{
+		return ufat_dir_mkfile(&dir_, &out, name);
+	}
+#endif
+
+	ufat_directory *get() noexcept { return &dir_; }
+	const ufat_directory *get() const noexcept { return &dir_; }
+
+private:
+	ufat_directory		dir_ = { };
+};
+
+inline directory volume::root() noexcept
+{
+	ufat_directory dir;
+
+	ufat_open_root(&uf_, &dir);
+	return directory(dir);
+}
+
+/**
+ * An open file. Each file object holds its own position and a copy of the
+ * file's size, so it can be moved but not copied: two copies writing the
+ * same file would disagree about its size.
+ */
+
+class file {
+public:
+	file() noexcept = default;
+
+	file(file &&o) noexcept : f_(o.f_), open_(o.open_)
+	{
+		o.open_ = false;
+	}
+
+	file &operator=(file &&o) noexcept
+	{
+		f_ = o.f_;
+		open_ = o.open_;
+		o.open_ = false;
+		return *this;
+	}
+
+	file(const file &) = delete;
+	file &operator=(const file &) = delete;
+
+	/** Opens a file (see `ufat_open_file()`). */
+	int open(volume &v, const ufat_dirent &ent) noexcept
+	{
+		const int err = ufat_open_file(v.get(), &f_, &ent);
+
+		open_ = !err;
+		return err;
+	}
+
+	bool is_open() const noexcept { return open_; }
+
+	/** Reads up to `buf.size()` bytes. Returns the number read. */
+	int read(byte_span buf) noexcept
+	{
+		return ufat_file_read(&f_, buf.data(), clamp(buf.size()));
+	}
+
+#ifndef UFAT_READ_ONLY
+	/**
+	 * Writes `buf`. Returns the number of bytes written, which may be
+	 * fewer than requested: a single call writes at most 1 GiB.
+	 */
+	int write(const_byte_span buf) noexcept
+	{
+		return ufat_file_write(&f_, buf.data(), clamp(buf.size()));
+	}
+
+	/** Truncates the file at the current position. */
+	int truncate() noexcept { return ufat_file_truncate(&f_); }
+#endif
+
+	int advance(ufat_size_t n) noexcept
+	{
+		return ufat_file_advance(&f_, n);
+	}
+
+	/** Sets the position (see `ufat_file_seek()`). */
+	int seek(ufat_size_t pos) noexcept
+	{
+		return ufat_file_seek(&f_, pos);
+	}
+
+	void rewind() noexcept { ufat_file_rewind(&f_); }
+
+	ufat_size_t size() const noexcept { return f_.file_size; }
+	ufat_size_t tell() const noexcept { return f_.cur_pos; }
+
+	ufat_file *get() noexcept { return &f_; }
+	const ufat_file *get() const noexcept { return &f_; }
+
+private:
+	/* Transfers are limited to what the return value can count */
+	static ufat_size_t clamp(std::size_t n) noexcept
+	{
+		const std::size_t max = (1u << 30);
+
+		return n > max ? max : n;
+	}
+
+	ufat_file	f_;
+	bool		open_ = false;
+};
+
+} // namespace ufatpp
+
+#endif
@@ -144,6 +144,7 @@ int ufat_dir_read(struct ufat_directory *dir, struct ufat_dirent *inf,
 	return 0;
 }
 
+#ifndef UFAT_READ_ONLY
 static int verify_empty_dir(struct ufat *uf, struct ufat_dirent *ent)
 {
 	struct ufat_directory dir;
@@ -170,7 +171,7 @@ static int verify_empty_dir(struct ufat *uf, struct ufat_dirent *ent)
 	return 0;
 }
 
-static int delete_entry(struct ufat *uf, struct ufat_dirent *ent)
+int ufat_delete_entry(struct ufat *uf, const struct ufat_dirent *ent)
 {
 	static const uint8_t del_marker = 0xe5;
 	struct ufat_directory dir;
@@ -217,10 +218,12 @@ int ufat_dir_delete(struct ufat *uf, struct ufat_dirent *ent)
 			return err;
 	}
 
-	err = delete_entry(uf, ent);
+	err = ufat_delete_entry(uf, ent);
 	if (err < 0)
 		return err;
 
+	/* Free the clusters only once nothing on disk points to them */
+	ufat_cache_barrier(uf);
 	return ufat_free_chain(uf, ent->first_cluster);
 }
 
@@ -231,7 +234,9 @@ static int create_empty_dir(struct ufat_directory *parent,
 {
 	struct ufat_dirent ent;
 	ufat_cluster_t c;
-	int err = ufat_alloc_chain(parent->uf, 1, &c);
+	int err = ufat_alloc_chain(parent->uf, 1,
+				   ufat_dir_hint(&parent->uf->bpb,
+						 parent->start), &c);
 	int idx;
 
 	if (err < 0)
@@ -252,7 +257,11 @@ static int create_empty_dir(struct ufat_directory *parent,
 		return idx;
 	}
 
-	ufat_cache_write(parent->uf, idx);
+	err = ufat_cache_write(parent->uf, idx);
+	if (err < 0) {
+		ufat_free_chain(parent->uf, c);
+		return err;
+	}
 
 	/* Create "." */
 	memcpy(&ent, downptr, sizeof(ent));
@@ -281,16 +290,51 @@ static int create_empty_dir(struct ufat_directory *parent,
 	return 0;
 }
 
+/* Write the LFN fragments and the DOS entry for a new entry, starting at
+ * the directory's current position. The short name must already be chosen.
+ */
+static int write_dirent_run(struct ufat_directory *dir,
+			    struct ufat_dirent *ent, const uint16_t *ucs2_name,
+			    int num_lfn_frags, int can_alloc)
+{
+	const uint8_t checksum =
+		ufat_short_checksum(ent->short_name, ent->short_ext);
+	uint8_t data[UFAT_DIRENT_SIZE];
+	int err;
+	int i;
+
+	ent->lfn_block = dir->cur_block;
+	ent->lfn_pos = dir->cur_pos;
+
+	/* Write LFN fragments and the DOS dirent */
+	for (i = 0; i < num_lfn_frags; i++) {
+		ufat_lfn_pack_fragment(ucs2_name + (num_lfn_frags - i - 1) * 13,
+				       num_lfn_frags - i, !i,
+				       data, checksum);
+
+		err = ufat_write_raw_dirent(dir, data, sizeof(data));
+		if (err < 0)
+			return err;
+
+		err = ufat_advance_raw_dirent(dir, can_alloc);
+		if (err < 0)
+			return err;
+	}
+
+	ufat_pack_dirent(ent, data);
+	ent->dirent_block = dir->cur_block;
+	ent->dirent_pos = dir->cur_pos;
+
+	return ufat_write_raw_dirent(dir, data, sizeof(data));
+}
+
 static int insert_dirent(struct ufat_directory *dir, struct ufat_dirent *ent,
 			 const char *long_name)
 {
 	uint16_t ucs2_name[UFAT_LFN_MAX_CHARS];
-	uint8_t data[UFAT_DIRENT_SIZE];
-	uint8_t checksum;
 	int ucs2_len = ufat_utf8_to_ucs2(long_name, ucs2_name);
 	int num_lfn_frags;
 	int err;
-	int i;
 
 	/* Check that the UTF8 was encoded correctly */
 	if (ucs2_len < 0)
@@ -310,36 +354,32 @@ static int insert_dirent(struct ufat_directory *dir, struct ufat_dirent *ent,
 		ufat_short_next(ent->short_name);
 	}
 
-	checksum = ufat_short_checksum(ent->short_name, ent->short_ext);
-
 	/* Find a space in the directory */
 	err = ufat_allocate_raw_dirent(dir, num_lfn_frags + 1);
 	if (err < 0)
 		return err;
 
-	ent->lfn_block = dir->cur_block;
-	ent->lfn_pos = dir->cur_pos;
+	return write_dirent_run(dir, ent, ucs2_name, num_lfn_frags, 0);
+}
 
-	/* Write LFN fragments and the DOS dirent */
-	for (i = 0; i < num_lfn_frags; i++) {
-		ufat_lfn_pack_fragment(ucs2_name + (num_lfn_frags - i - 1) * 13,
-				       num_lfn_frags - i, !i,
-				       data, checksum);
+/* Insert an entry into a directory which holds only "." and "..". No
+ * short name can collide, and the entry goes straight after "..".
+ */
+static int insert_first_dirent(struct ufat_directory *dir,
+			       struct ufat_dirent *ent, const char *long_name)
+{
+	uint16_t ucs2_name[UFAT_LFN_MAX_CHARS];
+	int ucs2_len = ufat_utf8_to_ucs2(long_name, ucs2_name);
 
-		err = ufat_write_raw_dirent(dir, data, sizeof(data));
-		if (err < 0)
-			return err;
+	if (ucs2_len < 0)
+		return ucs2_len;
 
-		err = ufat_advance_raw_dirent(dir, 0);
-		if (err < 0)
-			return err;
-	}
+	ufat_short_first(long_name, ent->short_name, ent->short_ext);
 
-	ufat_pack_dirent(ent, data);
-	ent->dirent_block = dir->cur_block;
-	ent->dirent_pos = dir->cur_pos;
+	dir->cur_block = dir->start;
+	dir->cur_pos = 2;
 
-	return ufat_write_raw_dirent(dir, data, sizeof(data));
+	return write_dirent_run(dir, ent, ucs2_name, (ucs2_len + 12) / 13, 1);
 }
 
 int ufat_dir_create(struct ufat_directory *dir, struct ufat_dirent *ent,
@@ -362,6 +402,7 @@ int ufat_dir_create(struct ufat_directory *dir, struct ufat_dirent *ent,
 	ent->attributes = (ent->attributes & UFAT_ATTR_USER) |
 		UFAT_ATTR_DIRECTORY;
 
+	ufat_cache_barrier(dir->uf);
 	err = insert_dirent(dir, ent, name);
 	if (err < 0) {
 		ufat_free_chain(dir->uf, ent->first_cluster);
@@ -394,25 +435,234 @@ int ufat_dir_mkfile(struct ufat_directory *dir, struct ufat_dirent *ent,
 	return 0;
 }
 
-int ufat_dir_find(struct ufat_directory *dir,
-		  const char *target, struct ufat_dirent *inf)
+/* Copy one path component, and return its length in the path */
+static int copy_component(const char *path, char *out)
 {
+	int len = 0;
+
+	while (path[len] && path[len] != '/' && path[len] != '\\') {
+		if (len + 1 >= UFAT_LFN_MAX_UTF8)
+			return -UFAT_ERR_NAME_TOO_LONG;
+
+		out[len] = path[len];
+		len++;
+	}
+
+	out[len] = 0;
+	return len;
+}
+
+/* Free a chain of new directories which was never linked in. Each holds
+ * at most one entry: the next directory.
+ */
+static void free_new_dirs(struct ufat *uf, ufat_cluster_t c)
+{
+	while (UFAT_CLUSTER_IS_PTR(c)) {
+		struct ufat_directory dir;
+		struct ufat_dirent e;
+		ufat_cluster_t next = 0;
+
+		dir.uf = uf;
+		dir.start = cluster_to_block(&uf->bpb, c);
+		ufat_dir_rewind(&dir);
+
+		while (!ufat_dir_read(&dir, &e, NULL, 0))
+			if (e.short_name[0] != '.')
+				next = e.first_cluster;
+
+		ufat_free_chain(uf, c);
+		c = next;
+	}
+}
+
+int ufat_dir_create_path(struct ufat_directory *dir, struct ufat_dirent *ent,
+			 const char *path)
+{
+	const struct ufat_dirent tmpl = *ent;
+	struct ufat_directory base;
+	struct ufat_directory parent;
+	struct ufat_directory last_parent;
+	struct ufat_dirent top;
+	int depth = 0;
+	char name[UFAT_LFN_MAX_UTF8];
+	const char *top_name;
+	int err;
+
+	/* Only the missing part of the path is looked up and created */
+	err = ufat_dir_find_path(dir, path, &top, &path);
+	if (err < 0)
+		return err;
+
+	if (!err) {
+		if (!(top.attributes & UFAT_ATTR_DIRECTORY))
+			return -UFAT_ERR_FILE_EXISTS;
+
+		*ent = top;
+		return 0;
+	}
+
+	/* The first new directory isn't linked in until the others are
+	 * written. Each of the others goes into a directory which is still
+	 * empty, so there's nothing to search.
+	 */
+	base = *dir;
+	parent = base;
+	last_parent = base;
+	top_name = path;
+	top.first_cluster = 0;
+
+	while (*path) {
+		struct ufat_dirent *e = depth ? ent : &top;
+		ufat_cluster_t c;
+
+		if (*path == '/' || *path == '\\') {
+			path++;
+			continue;
+		}
+
+		err = copy_component(path, name);
+		if (err < 0)
+			goto fail;
+
+		path += err;
+
+		if (!ufat_lfn_is_legal(name)) {
+			err = -UFAT_ERR_ILLEGAL_NAME;
+			goto fail;
+		}
+
+		err = create_empty_dir(&parent, &c, &tmpl);
+		if (err < 0)
+			goto fail;
+
+		*e = tmpl;
+		e->first_cluster = c;
+		e->file_size = 0;
+		e->attributes = (e->attributes & UFAT_ATTR_USER) |
+			UFAT_ATTR_DIRECTORY;
+
+		if (depth) {
+			err = insert_first_dirent(&parent, e, name);
+			if (err < 0) {
+				ufat_free_chain(dir->uf, c);
+				goto fail;
+			}
+
+			last_parent = parent;
+		}
+
+		parent.start = cluster_to_block(&dir->uf->bpb, c);
+		ufat_dir_rewind(&parent);
+		depth++;
+	}
+
+	/* Everything below the first new directory goes to disk before it
+	 * can be reached
+	 */
+	ufat_cache_barrier(dir->uf);
+
+	copy_component(top_name, name);
+	err = insert_dirent(&base, &top, name);
+	if (err < 0)
+		goto fail;
+
+	if (depth > 1) {
+		*dir = last_parent;
+	} else {
+		*ent = top;
+		*dir = base;
+	}
+
 	ufat_dir_rewind(dir);
+	return 0;
+
+fail:
+	free_new_dirs(dir->uf, top.first_cluster);
+	return err;
+}
+#endif
+
+/* Read entries until one matches the given name. This is equivalent to
+ * comparing the names returned by ufat_dir_read(), but long names are
+ * compared fragment by fragment as they're read. Neither the long name nor
+ * its UTF-8 form is ever assembled, which keeps lookups light on stack.
+ *
+ * Returns 0 if an entry is found, or 1 if not.
+ */
+static int find_entry(struct ufat_directory *dir, const char *target,
+		      int component_only, struct ufat_dirent *inf)
+{
+	struct ufat_lfn_matcher m;
+
+	ufat_lfn_match_reset(&m);
 
 	for (;;) {
-		char name[UFAT_LFN_MAX_UTF8];
-		int err = ufat_dir_read(dir, inf, name, sizeof(name));
+		uint8_t data[UFAT_DIRENT_SIZE];
+		char short_name[sizeof(inf->short_name) +
+				sizeof(inf->short_ext)];
+		int err;
 
+		inf->dirent_block = dir->cur_block;
+		inf->dirent_pos = dir->cur_pos;
+
+		err = ufat_read_raw_dirent(dir, data);
 		if (err)
 			return err;
 
-		if (ufat_compare_name(target, name, 0) >= 0)
-			break;
-	}
+		err = ufat_advance_raw_dirent(dir, 0);
+		if (err)
+			return err;
 
-	return 0;
+		if (data[0x0b] == 0x0f && data[0] != 0xe5) {
+			ufat_lfn_match(&m, data, inf->dirent_block,
+				       inf->dirent_pos, target, component_only);
+			continue;
+		}
+
+		if (!data[0] || data[0] == 0xe5) {
+			ufat_lfn_match_reset(&m);
+			continue;
+		}
+
+		ufat_parse_dirent(dir->uf->bpb.type, data, inf);
+
+		if (ufat_short_checksum(inf->short_name, inf->short_ext) !=
+		    m.short_checksum)
+			ufat_lfn_match_reset(&m);
+
+		if (inf->attributes & 0x08) {
+			ufat_lfn_match_reset(&m);
+			continue;
+		}
+
+		if (ufat_lfn_match_ok(&m)) {
+			inf->lfn_block = m.start_block;
+			inf->lfn_pos = m.start_pos;
+
+			if (m.match)
+				return 0;
+		} else {
+			inf->lfn_block = UFAT_BLOCK_NONE;
+			inf->lfn_pos = 0;
+
+			if (!ufat_format_short(inf->short_name, inf->short_ext,
+					       short_name,
+					       sizeof(short_name)) &&
+			    ufat_compare_name(target, short_name,
+					      component_only) >= 0)
+				return 0;
+		}
+
+		ufat_lfn_match_reset(&m);
+	}
 }
 
+int ufat_dir_find(struct ufat_directory *dir,
+		  const char *target, struct ufat_dirent *inf)
+{
+	ufat_dir_rewind(dir);
+	return find_entry(dir, target, 0, inf);
+}
 
 int ufat_dir_find_path(struct ufat_directory *dir,
 		       const char *path, struct ufat_dirent *ent,
@@ -424,6 +674,7 @@ int ufat_dir_find_path(struct ufat_directory *dir,
 
 	while (*path) {
 		int len = 0;
+		int err;
 
 		/* Ignore blank components */
 		if (*path == '/' || *path == '\\') {
@@ -433,32 +684,25 @@ int ufat_dir_find_path(struct ufat_directory *dir,
 
 		/* Descend if necessary */
 		if (!at_root) {
-			int err = ufat_open_subdir(dir->uf, dir, ent);
-
+			err = ufat_open_subdir(dir->uf, dir, ent);
 			if (err < 0)
 				return err;
 		}
 
 		/* Search for this component */
-		for (;;) {
-			char name[UFAT_LFN_MAX_UTF8];
-			int err = ufat_dir_read(dir, ent,
-						name, sizeof(name));
-
-			if (err < 0)
-				return err;
-
-			if (err) {
-				if (path_out)
-					*path_out = path;
-				return 1;
-			}
+		err = find_entry(dir, path, 1, ent);
+		if (err < 0)
+			return err;
 
-			len = ufat_compare_name(path, name, 1);
-			if (len >= 0)
-				break;
+		if (err) {
+			if (path_out)
+				*path_out = path;
+			return 1;
 		}
 
+		while (path[len] && path[len] != '/' && path[len] != '\\')
+			len++;
+
 		/* Skip over this component */
 		path += len;
 		if (*path)
@@ -513,6 +757,7 @@ int ufat_get_filename(struct ufat *uf,
 	return format_name(&lfn, ent, name_buf, max_len);
 }
 
+#ifndef UFAT_READ_ONLY
 int ufat_move(struct ufat_dirent *ent, struct ufat_directory *dst,
 	      const char *new_name)
 {
@@ -533,11 +778,14 @@ int ufat_move(struct ufat_dirent *ent, struct ufat_directory *dst,
 	if (err < 0)
 		return err;
 
-	err = delete_entry(dst->uf, ent);
+	/* If interrupted, leave the file in both places rather than neither */
+	ufat_cache_barrier(dst->uf);
+	err = ufat_delete_entry(dst->uf, ent);
 	if (err < 0) {
-		delete_entry(dst->uf, &new_ent);
+		ufat_delete_entry(dst->uf, &new_ent);
 		return err;
 	}
 
 	return 0;
 }
+#endif
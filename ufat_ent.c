@@ -37,10 +37,12 @@
 #include "ufat.h"
 #include "ufat_internal.h"
 
+#ifndef UFAT_READ_ONLY
 int ufat_write_raw_dirent(struct ufat_directory *dir,
 			  const uint8_t *data, unsigned int len)
 {
 	int idx;
+	int err;
 
 	if (dir->cur_block == UFAT_BLOCK_NONE)
 		return -UFAT_ERR_IO;
@@ -49,7 +51,9 @@ int ufat_write_raw_dirent(struct ufat_directory *dir,
 	if (idx < 0)
 		return idx;
 
-	ufat_cache_write(dir->uf, idx);
+	err = ufat_cache_write(dir->uf, idx);
+	if (err < 0)
+		return err;
 	memcpy(ufat_cache_data(dir->uf, idx) +
 	       dir->cur_pos * UFAT_DIRENT_SIZE,
 	       data, len);
@@ -57,6 +61,38 @@ int ufat_write_raw_dirent(struct ufat_directory *dir,
 	return 0;
 }
 
+/* Extend a directory by one cluster, and move on to it */
+static int extend_dir(struct ufat_directory *dir, ufat_cluster_t cur_cluster)
+{
+	const struct ufat_bpb *bpb = &dir->uf->bpb;
+	ufat_cluster_t next_cluster;
+	int err;
+
+	/* Try to get a new cluster, preferably adjacent to this one */
+	err = ufat_alloc_chain(dir->uf, 1, cur_cluster, &next_cluster);
+	if (err < 0)
+		return err;
+
+	err = ufat_init_dirent_cluster(dir->uf, next_cluster);
+	if (err < 0) {
+		ufat_free_chain(dir->uf, next_cluster);
+		return err;
+	}
+
+	/* The new cluster must be allocated and cleared before it's linked */
+	ufat_cache_barrier(dir->uf);
+
+	err = ufat_write_fat(dir->uf, cur_cluster, next_cluster);
+	if (err < 0) {
+		ufat_free_chain(dir->uf, next_cluster);
+		return err;
+	}
+
+	dir->cur_block = cluster_to_block(bpb, next_cluster);
+	return 0;
+}
+#endif
+
 static int advance_block_in_chain(struct ufat_directory *dir, int can_alloc)
 {
 	const struct ufat_bpb *bpb = &dir->uf->bpb;
@@ -84,29 +120,14 @@ static int advance_block_in_chain(struct ufat_directory *dir, int can_alloc)
 	}
 
 	/* This is the end of the chain. If we can't allocate, we're done. */
-	if (!can_alloc) {
-		dir->cur_block = UFAT_BLOCK_NONE;
-		return 0;
-	}
-
-	/* Try to get a new cluster */
-	err = ufat_alloc_chain(dir->uf, 1, &next_cluster);
-	if (err < 0)
-		return err;
-
-	err = ufat_init_dirent_cluster(dir->uf, next_cluster);
-	if (err < 0) {
-		ufat_free_chain(dir->uf, next_cluster);
-		return err;
-	}
-
-	err = ufat_write_fat(dir->uf, cur_cluster, next_cluster);
-	if (err < 0) {
-		ufat_free_chain(dir->uf, next_cluster);
-		return err;
-	}
-
-	dir->cur_block = cluster_to_block(bpb, next_cluster);
+#ifdef UFAT_READ_ONLY
+	(void)can_alloc;
+#else
+	if (can_alloc)
+		return extend_dir(dir, cur_cluster);
+#endif
+
+	dir->cur_block = UFAT_BLOCK_NONE;
 	return 0;
 }
 
@@ -151,6 +172,7 @@ int ufat_read_raw_dirent(struct ufat_directory *dir, uint8_t *data)
 	return 0;
 }
 
+#ifndef UFAT_READ_ONLY
 int ufat_allocate_raw_dirent(struct ufat_directory *dir, unsigned int count)
 {
 	ufat_block_t empty_start = UFAT_BLOCK_NONE;
@@ -202,25 +224,56 @@ int ufat_allocate_raw_dirent(struct ufat_directory *dir, unsigned int count)
 
 int ufat_init_dirent_cluster(struct ufat *uf, ufat_cluster_t c)
 {
+	static const uint8_t zero_run[UFAT_ZERO_RUN_BYTES];
 	const struct ufat_bpb *bpb = &uf->bpb;
 	const ufat_block_t start = cluster_to_block(bpb, c);
 	const unsigned int count =
 		1 << bpb->log2_blocks_per_cluster;
 	const unsigned int block_size = 1 << uf->dev->log2_block_size;
-	int i;
+	unsigned int run = UFAT_ZERO_RUN_BYTES >> uf->dev->log2_block_size;
+	const uint8_t *zero = zero_run;
+	unsigned int i;
+	int idx;
+	int err;
 
-	for (i = count - 1; i >= 0; i--) {
-		int idx = ufat_cache_open(uf, start + i, 1);
+	/* Only the first block is cached, since that's where the caller
+	 * will put "." and "..". Stale copies of the rest must go.
+	 */
+	ufat_cache_invalidate(uf, start + 1, count - 1);
 
-		if (idx < 0)
-			return idx;
+	idx = ufat_cache_open(uf, start, 1);
+	if (idx < 0)
+		return idx;
 
-		ufat_cache_write(uf, idx);
-		memset(ufat_cache_data(uf, idx), 0, block_size);
+	err = ufat_cache_write(uf, idx);
+	if (err < 0)
+		return err;
+
+	memset(ufat_cache_data(uf, idx), 0, block_size);
+
+	/* The remaining blocks are written straight from a run of zeroes,
+	 * so that they don't displace anything else in the cache. If the
+	 * run is big enough, that's a single request. Blocks larger than
+	 * the run are written from the zeroed cache slot.
+	 */
+	if (!run) {
+		zero = ufat_cache_data(uf, idx);
+		run = 1;
+	}
+
+	for (i = 1; i < count; i += run) {
+		const unsigned int n = count - i < run ? count - i : run;
+
+		if (ufat_dev_write(uf, UFAT_IO_METADATA, start + i, n, zero) < 0)
+			return -UFAT_ERR_IO;
+
+		uf->stat.write++;
+		uf->stat.write_blocks += n;
 	}
 
 	return 0;
 }
+#endif
 
 static void sn_copy(const uint8_t *src, char *dst, int len)
 {
@@ -254,6 +307,7 @@ void ufat_parse_dirent(ufat_fat_type_t type,
 	}
 }
 
+#ifndef UFAT_READ_ONLY
 void ufat_pack_dirent(const struct ufat_dirent *ent, uint8_t *data)
 {
 	memset(data, 0x20, 11);
@@ -272,11 +326,13 @@ void ufat_pack_dirent(const struct ufat_dirent *ent, uint8_t *data)
 	w16(data + 0x1a, ent->first_cluster & 0xffff);
 	w32(data + 0x1c, ent->file_size);
 }
+#endif
 
 /************************************************************************
  * Name/LFN manipulation
  */
 
+#ifndef UFAT_READ_ONLY
 int ufat_lfn_is_legal(const char *name)
 {
 	if (!*name)
@@ -402,6 +458,7 @@ int ufat_short_exists(struct ufat_directory *dir, const char *short_name,
 
 	return 0;
 }
+#endif
 
 void ufat_lfn_parse(struct ufat_lfn_parser *s, const uint8_t *data,
 		    ufat_block_t blk, unsigned int pos)
@@ -443,6 +500,108 @@ void ufat_lfn_parse(struct ufat_lfn_parser *s, const uint8_t *data,
 		s->buf[fr_pos + i] = frag_data[i];
 }
 
+/* Decode the next character of a search name. Returns -1 at the end of the
+ * name (or component), or a value above 0xffff, which matches nothing, for
+ * anything which isn't valid UTF-8 for a UCS-2 character.
+ */
+static long name_next(const char **name, int component_only)
+{
+	const uint8_t *s = (const uint8_t *)*name;
+	long c = s[0];
+
+	if (!c || (component_only && (c == '/' || c == '\\')))
+		return -1;
+
+	if ((c & 0xf0) == 0xe0 &&
+	    (s[1] & 0xc0) == 0x80 && (s[2] & 0xc0) == 0x80) {
+		c = ((c & 0xf) << 12) | ((s[1] & 0x3f) << 6) | (s[2] & 0x3f);
+		*name += 3;
+		return c >= 0x800 ? c : 0x10000;
+	}
+
+	if ((c & 0xe0) == 0xc0 && (s[1] & 0xc0) == 0x80) {
+		c = ((c & 0x1f) << 6) | (s[1] & 0x3f);
+		*name += 2;
+		return c >= 0x80 ? c : 0x10000;
+	}
+
+	(*name)++;
+	return c & 0x80 ? 0x10000 : c;
+}
+
+static inline long fold_case(long c)
+{
+	return (c >= 'a' && c <= 'z') ? c - 32 : c;
+}
+
+void ufat_lfn_match(struct ufat_lfn_matcher *m, const uint8_t *data,
+		    ufat_block_t blk, unsigned int pos,
+		    const char *name, int component_only)
+{
+	static const uint8_t offsets[13] = {
+		0x01, 0x03, 0x05, 0x07, 0x09, 0x0e, 0x10,
+		0x12, 0x14, 0x16, 0x18, 0x1c, 0x1e
+	};
+	const int fr_seq = data[0];
+	const int fr_pos = ((fr_seq & 0x3f) - 1) * 13;
+	int fr_len = 13;
+	int i;
+
+	if (fr_pos < 0) {
+		ufat_lfn_match_reset(m);
+		return;
+	}
+
+	if (fr_pos + fr_len > UFAT_LFN_MAX_CHARS)
+		fr_len = UFAT_LFN_MAX_CHARS - fr_pos;
+
+	/* Check against expected sequence number and checksum */
+	if (fr_seq & 0x40) {
+		m->start_block = blk;
+		m->start_pos = pos;
+		m->seq = fr_seq & 0x3f;
+		m->short_checksum = data[0x0d];
+		m->match = 1;
+	} else if (fr_seq != m->seq ||
+		   m->short_checksum != data[0x0d]) {
+		ufat_lfn_match_reset(m);
+		return;
+	}
+	m->seq--;
+
+	if (!m->match)
+		return;
+
+	/* Fragments arrive last first, so find where this one starts in
+	 * the search name.
+	 */
+	for (i = 0; i < fr_pos; i++)
+		if (name_next(&name, component_only) < 0) {
+			m->match = 0;
+			return;
+		}
+
+	for (i = 0; i < fr_len; i++) {
+		const long c = r16(data + offsets[i]);
+		const long t = name_next(&name, component_only);
+
+		/* A terminator must coincide with the end of the name */
+		if (!c) {
+			m->match = t < 0;
+			return;
+		}
+
+		if (t < 0 || fold_case(c) != fold_case(t)) {
+			m->match = 0;
+			return;
+		}
+	}
+
+	/* The last fragment may be full, with no terminator */
+	if ((fr_seq & 0x40) && name_next(&name, component_only) >= 0)
+		m->match = 0;
+}
+
 int ufat_ucs2_to_utf8(const uint16_t *src, int src_len,
 		      char *dst, int dst_len)
 {
@@ -503,6 +662,7 @@ uint8_t ufat_short_checksum(const char *short_name, const char *short_ext)
 	return sum;
 }
 
+#ifndef UFAT_READ_ONLY
 int ufat_utf8_to_ucs2(const char *src, uint16_t *dst)
 {
 	int len = 0;
@@ -577,6 +737,7 @@ void ufat_lfn_pack_fragment(const uint16_t *ucs, int seq, int is_first,
 	w16(data + 0x1c, ucs[11]);
 	w16(data + 0x1e, ucs[12]);
 }
+#endif
 
 int ufat_format_short(const char *name, const char *ext,
 		      char *out, int max_len)
@@ -642,11 +803,13 @@ int ufat_compare_name(const char *search_name, const char *dir_name,
 	return m;
 }
 
+#ifndef UFAT_READ_ONLY
 int ufat_update_attributes(struct ufat *uf, struct ufat_dirent *ent)
 {
 	int idx = ufat_cache_open(uf, ent->dirent_block, 0);
 	uint8_t *data;
 	struct ufat_dirent old;
+	int err;
 
 	if (idx < 0)
 		return idx;
@@ -664,8 +827,12 @@ int ufat_update_attributes(struct ufat *uf, struct ufat_dirent *ent)
 	old.modify_time = ent->modify_time;
 	old.access_date = ent->access_date;
 
-	ufat_cache_write(uf, idx);
+	err = ufat_cache_write(uf, idx);
+	if (err < 0)
+		return err;
+
 	ufat_pack_dirent(&old, data);
 
 	return 0;
 }
+#endif
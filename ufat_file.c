@@ -49,6 +49,9 @@ int ufat_open_file(struct ufat *uf, struct ufat_file *f,
 	f->prev_cluster = 0;
 	f->cur_cluster = f->start;
 	f->cur_pos = 0;
+	f->op = UFAT_FILE_OP_NONE;
+	f->op_remaining = 0;
+	f->op_done = 0;
 
 	return 0;
 }
@@ -58,6 +61,9 @@ void ufat_file_rewind(struct ufat_file *f)
 	f->prev_cluster = 0;
 	f->cur_cluster = f->start;
 	f->cur_pos = 0;
+	f->op = UFAT_FILE_OP_NONE;
+	f->op_remaining = 0;
+	f->op_done = 0;
 }
 
 static int advance_ptr(struct ufat_file *f, ufat_size_t nbytes)
@@ -103,6 +109,55 @@ int ufat_file_advance(struct ufat_file *f, ufat_size_t nbytes)
 	return advance_ptr(f, nbytes);
 }
 
+int ufat_file_seek(struct ufat_file *f, ufat_size_t pos)
+{
+	const unsigned int log2_cluster_size =
+		f->uf->dev->log2_block_size +
+		f->uf->bpb.log2_blocks_per_cluster;
+
+	if (pos > f->file_size)
+		pos = f->file_size;
+
+	/* Positions within the current cluster need no chain lookups, and
+	 * the cluster before it is still the right one to link or cut.
+	 */
+	if ((pos >> log2_cluster_size) == (f->cur_pos >> log2_cluster_size)) {
+		f->cur_pos = pos;
+		return 0;
+	}
+
+	/* Going forward, only the clusters in between are followed. Going
+	 * back means starting again from the head of the chain, since the
+	 * FAT has no backward links.
+	 */
+	if (pos < f->cur_pos)
+		ufat_file_rewind(f);
+
+	return advance_ptr(f, pos - f->cur_pos);
+}
+
+/* File data on a mappable device is read straight from the mapping. Any
+ * cached copies of the blocks are written back first, since they may be
+ * newer. Requests are left to the dispatcher, if there is one, since it may
+ * hold newer copies too.
+ */
+static int map_blocks(struct ufat *uf, ufat_block_t start, ufat_block_t count,
+		      const uint8_t **out)
+{
+	int err;
+
+	*out = NULL;
+	if (!uf->map || uf->dispatch)
+		return 0;
+
+	err = ufat_cache_evict(uf, start, count);
+	if (err < 0)
+		return err;
+
+	*out = uf->map(uf->dev, start, count);
+	return 0;
+}
+
 static int read_block_fragment(struct ufat_file *f, char *buf, ufat_size_t size)
 {
 	const struct ufat_bpb *bpb = &f->uf->bpb;
@@ -114,6 +169,7 @@ static int read_block_fragment(struct ufat_file *f, char *buf, ufat_size_t size)
 		cluster_to_block(bpb, f->cur_cluster) +
 		((f->cur_pos >> log2_block_size) &
 		 ((1 << bpb->log2_blocks_per_cluster) - 1));
+	const uint8_t *mapped;
 	int i;
 
 	if (size > remainder)
@@ -125,11 +181,20 @@ static int read_block_fragment(struct ufat_file *f, char *buf, ufat_size_t size)
 	if (!UFAT_CLUSTER_IS_PTR(f->cur_cluster))
 		return -UFAT_ERR_INVALID_CLUSTER;
 
-	i = ufat_cache_open(f->uf, cur_block, 0);
+	i = map_blocks(f->uf, cur_block, 1, &mapped);
 	if (i < 0)
 		return i;
 
-	memcpy(buf, ufat_cache_data(f->uf, i) + offset, size);
+	if (mapped) {
+		memcpy(buf, mapped + offset, size);
+	} else {
+		i = ufat_cache_open(f->uf, cur_block, 0);
+		if (i < 0)
+			return i;
+
+		memcpy(buf, ufat_cache_data(f->uf, i) + offset, size);
+	}
+
 	i = advance_ptr(f, size);
 	if (i < 0)
 		return i;
@@ -150,6 +215,7 @@ static int read_blocks(struct ufat_file *f, char *buf, ufat_size_t size)
 		blocks_per_cluster - block_offset;
 	ufat_block_t starting_block;
 	unsigned int requested_blocks = size >> log2_block_size;
+	const uint8_t *mapped;
 	int i;
 
 	if (requested_blocks > block_remainder)
@@ -164,16 +230,25 @@ static int read_blocks(struct ufat_file *f, char *buf, ufat_size_t size)
 	 * cache and perform a single large read.
 	 */
 	starting_block = cluster_to_block(bpb, f->cur_cluster) + block_offset;
-	i = ufat_cache_evict(uf, starting_block, requested_blocks);
+	i = map_blocks(uf, starting_block, requested_blocks, &mapped);
 	if (i < 0)
 		return i;
 
-	i = uf->dev->read(uf->dev, starting_block, requested_blocks, buf);
-	if (i < 0)
-		return -UFAT_ERR_IO;
+	if (mapped) {
+		memcpy(buf, mapped, requested_blocks << log2_block_size);
+	} else {
+		i = ufat_cache_evict(uf, starting_block, requested_blocks);
+		if (i < 0)
+			return i;
 
-	uf->stat.read++;
-	uf->stat.read_blocks += requested_blocks;
+		i = ufat_dev_read(uf, UFAT_IO_READ, starting_block,
+				  requested_blocks, buf);
+		if (i < 0)
+			return -UFAT_ERR_IO;
+
+		uf->stat.read++;
+		uf->stat.read_blocks += requested_blocks;
+	}
 
 	i = advance_ptr(f, requested_blocks << log2_block_size);
 	if (i < 0)
@@ -221,14 +296,87 @@ int ufat_file_read(struct ufat_file *f, void *buf, ufat_size_t size)
 	return total;
 }
 
+int ufat_file_map(struct ufat_file *f, const void **ptr,
+		  ufat_size_t max_size)
+{
+	struct ufat *uf = f->uf;
+	const struct ufat_bpb *bpb = &uf->bpb;
+	const unsigned int log2_block_size = uf->dev->log2_block_size;
+	const ufat_size_t block_size = (ufat_size_t)1 << log2_block_size;
+	const ufat_size_t cluster_size =
+		block_size << bpb->log2_blocks_per_cluster;
+	const ufat_size_t offset = f->cur_pos & (cluster_size - 1);
+	ufat_size_t len = cluster_size - offset;
+	ufat_cluster_t c = f->cur_cluster;
+	const uint8_t *mapped;
+	ufat_block_t start;
+	int err;
+
+	if (max_size > f->file_size - f->cur_pos)
+		max_size = f->file_size - f->cur_pos;
+	if (!max_size)
+		return 0;
+
+	if (!uf->map || uf->dispatch)
+		return -UFAT_ERR_NOT_MAPPED;
+
+	if (!UFAT_CLUSTER_IS_PTR(c))
+		return -UFAT_ERR_INVALID_CLUSTER;
+
+	/* Take in following clusters for as long as they're contiguous */
+	while (len < max_size) {
+		ufat_cluster_t next;
+
+		err = ufat_read_fat(uf, c, &next);
+		if (err < 0)
+			return err;
+
+		if (next != c + 1)
+			break;
+
+		c = next;
+		len += cluster_size;
+	}
+
+	if (len > max_size)
+		len = max_size;
+
+	start = cluster_to_block(bpb, f->cur_cluster) +
+		(offset >> log2_block_size);
+	err = map_blocks(uf, start,
+			 ((offset & (block_size - 1)) + len + block_size - 1) >>
+			 log2_block_size, &mapped);
+	if (err < 0)
+		return err;
+
+	if (!mapped)
+		return -UFAT_ERR_NOT_MAPPED;
+
+	err = advance_ptr(f, len);
+	if (err < 0)
+		return err;
+
+	*ptr = mapped + (offset & (block_size - 1));
+	return len;
+}
+
+#ifndef UFAT_READ_ONLY
 static int set_size(struct ufat_file *f, ufat_size_t s)
 {
-	int idx = ufat_cache_open(f->uf, f->dirent_block, 0);
+	int idx;
+	int err;
 
+	/* Data and clusters covered by the new size go to disk first */
+	ufat_cache_barrier(f->uf);
+
+	idx = ufat_cache_open(f->uf, f->dirent_block, 0);
 	if (idx < 0)
 		return idx;
 
-	ufat_cache_write(f->uf, idx);
+	err = ufat_cache_write(f->uf, idx);
+	if (err < 0)
+		return err;
+
 	w32(ufat_cache_data(f->uf, idx) +
 	    f->dirent_pos * UFAT_DIRENT_SIZE + 0x1c, s);
 
@@ -240,11 +388,15 @@ static int set_start(struct ufat_file *f, ufat_cluster_t s)
 {
 	int idx = ufat_cache_open(f->uf, f->dirent_block, 0);
 	uint8_t *data;
+	int err;
 
 	if (idx < 0)
 		return idx;
 
-	ufat_cache_write(f->uf, idx);
+	err = ufat_cache_write(f->uf, idx);
+	if (err < 0)
+		return err;
+
 	data = ufat_cache_data(f->uf, idx) + f->dirent_pos * UFAT_DIRENT_SIZE;
 	w16(data + 0x14, s >> 16);
 	w16(data + 0x1a, s & 0xffff);
@@ -255,16 +407,33 @@ static int set_start(struct ufat_file *f, ufat_cluster_t s)
 
 static int ensure_room(struct ufat_file *f)
 {
+	ufat_cluster_t hint = f->prev_cluster;
 	ufat_cluster_t c;
 	int err;
 
 	if (UFAT_CLUSTER_IS_PTR(f->cur_cluster))
 		return 0;
 
-	err = ufat_alloc_chain(f->uf, 1, &c);
+	/* Extend the file contiguously if possible. The first cluster of a
+	 * file is placed near the directory which contains it.
+	 */
+	if (!UFAT_CLUSTER_IS_PTR(hint))
+		hint = ufat_dir_hint(&f->uf->bpb, f->dirent_block);
+
+	err = ufat_alloc_chain(f->uf, 1, hint, &c);
 	if (err < 0)
 		return err;
 
+	/* The link to the new cluster mustn't reach the disk before its
+	 * allocation does. That's only a risk if they're in different blocks.
+	 * Leaving out the barrier for the common case (extending within one
+	 * FAT block) also means the FAT block isn't written back each time a
+	 * cluster is added.
+	 */
+	if (!UFAT_CLUSTER_IS_PTR(f->prev_cluster) ||
+	    !ufat_fat_same_block(f->uf, f->prev_cluster, c))
+		ufat_cache_barrier(f->uf);
+
 	if (UFAT_CLUSTER_IS_PTR(f->prev_cluster))
 		err = ufat_write_fat(f->uf, f->prev_cluster, c);
 	else
@@ -289,6 +458,7 @@ static int write_block_fragment(struct ufat_file *f, const char *buf,
 	const unsigned int remainder = block_size - offset;
 	ufat_block_t cur_block;
 	int i;
+	int err;
 
 	if (size > remainder)
 		size = remainder;
@@ -309,7 +479,10 @@ static int write_block_fragment(struct ufat_file *f, const char *buf,
 	if (i < 0)
 		return i;
 
-	ufat_cache_write(f->uf, i);
+	err = ufat_cache_write(f->uf, i);
+	if (err < 0)
+		return err;
+
 	memcpy(ufat_cache_data(f->uf, i) + offset, buf, size);
 
 	i = advance_ptr(f, size);
@@ -349,7 +522,8 @@ static int write_blocks(struct ufat_file *f, const char *buf, ufat_size_t size)
 	starting_block = cluster_to_block(bpb, f->cur_cluster) + block_offset;
 	ufat_cache_invalidate(uf, starting_block, requested_blocks);
 
-	i = uf->dev->write(uf->dev, starting_block, requested_blocks, buf);
+	i = ufat_dev_write(uf, UFAT_IO_WRITE, starting_block, requested_blocks,
+			   buf);
 	if (i < 0)
 		return -UFAT_ERR_IO;
 
@@ -408,7 +582,104 @@ int ufat_file_write(struct ufat_file *f, const void *buf, ufat_size_t len)
 
 	return total;
 }
+#endif
+
+void ufat_file_read_begin(struct ufat_file *f, void *buf, ufat_size_t size)
+{
+	if (size > f->file_size - f->cur_pos)
+		size = f->file_size - f->cur_pos;
+
+	f->op = UFAT_FILE_OP_READ;
+	f->op_read_buf = buf;
+	f->op_remaining = size;
+	f->op_done = 0;
+}
+
+#ifndef UFAT_READ_ONLY
+void ufat_file_write_begin(struct ufat_file *f, const void *buf,
+			   ufat_size_t len)
+{
+	const ufat_size_t max_write = ~f->cur_pos;
+
+	if (len > max_write)
+		len = max_write;
+
+	f->op = UFAT_FILE_OP_WRITE;
+	f->op_write_buf = buf;
+	f->op_remaining = len;
+	f->op_done = 0;
+}
+#endif
+
+static int op_step(struct ufat_file *f)
+{
+	char *buf;
+	int len;
+
+#ifndef UFAT_READ_ONLY
+	if (f->op == UFAT_FILE_OP_WRITE) {
+		const char *src = f->op_write_buf + f->op_done;
+
+		len = write_block_fragment(f, src, f->op_remaining);
+		if (!len)
+			len = write_blocks(f, src, f->op_remaining);
+
+		return len;
+	}
+#endif
+
+	buf = f->op_read_buf + f->op_done;
+	len = read_block_fragment(f, buf, f->op_remaining);
+	if (!len)
+		len = read_blocks(f, buf, f->op_remaining);
+
+	return len;
+}
+
+int ufat_file_step(struct ufat_file *f, unsigned int max_requests)
+{
+	const struct ufat_stat *st = &f->uf->stat;
+	const unsigned int start = st->read + st->write;
+	int err = 0;
+
+	if (f->op == UFAT_FILE_OP_NONE)
+		return 0;
+
+	while (f->op_remaining) {
+		int len;
+
+		if (st->read + st->write - start >= max_requests)
+			return 1;
+
+		len = op_step(f);
+		if (len < 0) {
+			err = len;
+			break;
+		}
+
+		if (!len)
+			break;
+
+		f->op_remaining -= len;
+		f->op_done += len;
+	}
+
+#ifndef UFAT_READ_ONLY
+	/* The size is updated once, when the write completes */
+	if (f->op == UFAT_FILE_OP_WRITE && f->cur_pos > f->file_size) {
+		int i = set_size(f, f->cur_pos);
+
+		if (!err)
+			err = i;
+	}
+#endif
+
+	f->op = UFAT_FILE_OP_NONE;
+	f->op_remaining = 0;
+	return err < 0 ? err : 0;
+}
 
+#ifndef UFAT_READ_ONLY
 int ufat_file_truncate(struct ufat_file *f)
 {
 	const unsigned int
@@ -427,6 +698,8 @@ int ufat_file_truncate(struct ufat_file *f)
 		if (err < 0)
 			return err;
 
+		ufat_cache_barrier(f->uf);
+
 		if (UFAT_CLUSTER_IS_PTR(old_start)) {
 			err = ufat_free_chain(f->uf, old_start);
 			if (err < 0)
@@ -437,6 +710,9 @@ int ufat_file_truncate(struct ufat_file *f)
 		return 0;
 	}
 
+	/* The entry must stop covering clusters before they're freed */
+	ufat_cache_barrier(f->uf);
+
 	if (f->file_size & (cluster_size - 1)) {
 		ufat_cluster_t tail;
 
@@ -466,3 +742,4 @@ int ufat_file_truncate(struct ufat_file *f)
 
 	return 0;
 }
+#endif
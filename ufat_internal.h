@@ -83,6 +83,31 @@ static inline ufat_cluster_t block_to_cluster(const struct ufat_bpb *bpb,
 
 /* Block IO via internal cache */
 
+/* Device access. Requests go through the dispatcher, if there is one. */
+static inline int ufat_dev_read(struct ufat *uf, ufat_io_class_t cls,
+				ufat_block_t start, ufat_block_t count,
+				void *buffer)
+{
+	if (uf->dispatch)
+		return uf->dispatch->read(uf->dispatch, uf->dev, cls,
+					  start, count, buffer);
+
+	return uf->dev->read(uf->dev, start, count, buffer);
+}
+
+#ifndef UFAT_READ_ONLY
+static inline int ufat_dev_write(struct ufat *uf, ufat_io_class_t cls,
+				 ufat_block_t start, ufat_block_t count,
+				 const void *buffer)
+{
+	if (uf->dispatch)
+		return uf->dispatch->write(uf->dispatch, uf->dev, cls,
+					   start, count, buffer);
+
+	return uf->dev->write(uf->dev, start, count, buffer);
+}
+#endif
+
 /**
  * \brief Opens a block via cache.
  *
@@ -103,6 +128,28 @@ static inline ufat_cluster_t block_to_cluster(const struct ufat_bpb *bpb,
 
 int ufat_cache_open(struct ufat *uf, ufat_block_t blk_index, int skip_read);
 
+/**
+ * \brief Reads a range of blocks into free cache slots.
+ *
+ * Blocks which are already cached are skipped. Runs of adjacent free slots
+ * are filled with a single multi-block read. No cached block is evicted, so
+ * fewer blocks than requested may be read if the cache is short of free
+ * slots.
+ *
+ * \pre `uf` is a valid pointer.
+ * \pre The filesystem pointed by `uf` is opened.
+ *
+ * \param [in] uf is a pointer to the filesystem
+ * \param [in] start is the index of starting block of the range
+ * \param [in] count is the number of blocks in the range
+ *
+ * \return 0 on success, negative error code (`ufat_error_t`) otherwise
+ */
+
+int ufat_cache_prefetch(struct ufat *uf, ufat_block_t start,
+			ufat_block_t count);
+
+#ifndef UFAT_READ_ONLY
 /**
  * \brief Evicts (flushes) cached blocks which overlap with given range.
  *
@@ -117,6 +164,17 @@ int ufat_cache_open(struct ufat *uf, ufat_block_t blk_index, int skip_read);
  */
 
 int ufat_cache_evict(struct ufat *uf, ufat_block_t start, ufat_block_t count);
+#else
+/* Cached blocks are never newer than the device, so they can stay */
+static inline int ufat_cache_evict(struct ufat *uf, ufat_block_t start,
+				   ufat_block_t count)
+{
+	(void)uf;
+	(void)start;
+	(void)count;
+	return 0;
+}
+#endif
 
 /**
  * \brief Invalidates (drops) cached blocks which overlap with given range.
@@ -132,27 +190,65 @@ int ufat_cache_evict(struct ufat *uf, ufat_block_t start, ufat_block_t count);
 void ufat_cache_invalidate(struct ufat *uf, ufat_block_t start,
 			   ufat_block_t count);
 
-static inline void ufat_cache_write(struct ufat *uf, unsigned int cache_index)
+#ifndef UFAT_READ_ONLY
+/* Mark a cached block dirty, before changing it. If it was dirtied before
+ * the last barrier and other blocks have been dirtied since, it's written
+ * back first, so this can fail.
+ */
+int ufat_cache_write(struct ufat *uf, unsigned int cache_index);
+
+/* Start a new write-back epoch. Blocks dirtied after the barrier are never
+ * written back before those dirtied ahead of it. Use this between changes
+ * which depend on each other: a cluster must be allocated in the FAT before
+ * an entry points to it, and an entry removed before its clusters are
+ * freed.
+ */
+static inline void ufat_cache_barrier(struct ufat *uf)
 {
-	uf->stat.cache_write++;
-	uf->cache_desc[cache_index].flags |= UFAT_CACHE_FLAG_DIRTY;
+	uf->epoch++;
 }
+#endif
 
 static inline uint8_t *ufat_cache_data(struct ufat *uf,
 				       unsigned int cache_index)
 {
-	return uf->cache_data + (cache_index << uf->dev->log2_block_size);
+	return uf->cache->data + (cache_index << uf->cache->log2_block_size);
 }
 
 /* FAT entry IO */
 int ufat_read_fat(struct ufat *uf, ufat_cluster_t index,
 		  ufat_cluster_t *out);
+
+/* Count the clusters in a chain */
+int ufat_chain_length(struct ufat *uf, ufat_cluster_t start,
+		      ufat_cluster_t *count);
+#ifndef UFAT_READ_ONLY
+/* Are the entries for both clusters wholly within the same FAT block? */
+int ufat_fat_same_block(const struct ufat *uf, ufat_cluster_t a,
+			ufat_cluster_t b);
+
 int ufat_write_fat(struct ufat *uf, ufat_cluster_t index,
 		   ufat_cluster_t in);
 
-/* High-level FAT operations */
+/* High-level FAT operations.
+ *
+ * The allocation hint, if it's a valid cluster index, is where the search
+ * for free clusters starts. Otherwise, the filesystem-wide allocation
+ * pointer is used.
+ */
 int ufat_free_chain(struct ufat *uf, ufat_cluster_t start);
-int ufat_alloc_chain(struct ufat *uf, unsigned int count, ufat_cluster_t *out);
+int ufat_alloc_chain(struct ufat *uf, unsigned int count, ufat_cluster_t hint,
+		     ufat_cluster_t *out);
+
+static inline ufat_cluster_t ufat_dir_hint(const struct ufat_bpb *bpb,
+					   ufat_block_t b)
+{
+	if (b == UFAT_BLOCK_NONE || b < bpb->cluster_start)
+		return 0;
+
+	return block_to_cluster(bpb, b);
+}
+#endif
 
 /* LFN handling */
 struct ufat_lfn_parser {
@@ -178,26 +274,66 @@ static inline int ufat_lfn_ok(const struct ufat_lfn_parser *s)
 
 void ufat_lfn_parse(struct ufat_lfn_parser *s, const uint8_t *data,
 		    ufat_block_t blk, unsigned int pos);
+
+/* Streaming LFN comparison. Fragments are compared against a search name
+ * as they're read, rather than being assembled into a long name first.
+ * The result, in match, is only valid once the sequence is complete
+ * (ufat_lfn_match_ok()) and its checksum agrees with the short entry which
+ * follows.
+ */
+struct ufat_lfn_matcher {
+	ufat_block_t	start_block;
+	unsigned int	start_pos;
+
+	uint8_t		short_checksum;
+
+	int		seq;
+	int		match;
+};
+
+static inline void ufat_lfn_match_reset(struct ufat_lfn_matcher *m)
+{
+	m->seq = -1;
+}
+
+static inline int ufat_lfn_match_ok(const struct ufat_lfn_matcher *m)
+{
+	return m->seq == 0;
+}
+
+void ufat_lfn_match(struct ufat_lfn_matcher *m, const uint8_t *data,
+		    ufat_block_t blk, unsigned int pos,
+		    const char *name, int component_only);
+#ifndef UFAT_READ_ONLY
 int ufat_lfn_is_legal(const char *name);
 void ufat_lfn_pack_fragment(const uint16_t *ucs, int seq, int is_first,
 			    uint8_t *data, uint8_t checksum);
+#endif
 
 /* Raw dirent IO */
-int ufat_write_raw_dirent(struct ufat_directory *dir,
-			  const uint8_t *data, unsigned int len);
 int ufat_read_raw_dirent(struct ufat_directory *dir, uint8_t *data);
 int ufat_advance_raw_dirent(struct ufat_directory *dir, int can_alloc);
+#ifndef UFAT_READ_ONLY
+int ufat_write_raw_dirent(struct ufat_directory *dir,
+			  const uint8_t *data, unsigned int len);
 int ufat_allocate_raw_dirent(struct ufat_directory *dir, unsigned int count);
 int ufat_init_dirent_cluster(struct ufat *uf, ufat_cluster_t c);
 
+/* Write deletion markers over an entry and its LFN fragments */
+int ufat_delete_entry(struct ufat *uf, const struct ufat_dirent *ent);
+#endif
+
 /* Dirent parsing/packing */
 void ufat_parse_dirent(ufat_fat_type_t type,
 		       const uint8_t *data, struct ufat_dirent *inf);
+#ifndef UFAT_READ_ONLY
 void ufat_pack_dirent(const struct ufat_dirent *ent, uint8_t *data);
+#endif
 
 /* Charset conversion */
 int ufat_ucs2_to_utf8(const uint16_t *src, int src_len,
 		      char *dst, int dst_len);
+#ifndef UFAT_READ_ONLY
 int ufat_utf8_to_ucs2(const char *src, uint16_t *dst);
 
 /* Short name functions */
@@ -206,6 +342,7 @@ void ufat_short_first(const char *long_name,
 void ufat_short_next(char *short_name);
 int ufat_short_exists(struct ufat_directory *dir, const char *short_name,
 		      const char *short_ext);
+#endif
 uint8_t ufat_short_checksum(const char *short_name, const char *short_ext);
 int ufat_format_short(const char *name, const char *ext,
 		      char *out, int max_len);
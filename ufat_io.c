@@ -0,0 +1,257 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "ufat.h"
+#include "ufat_internal.h"
+
+void ufat_set_dispatch(struct ufat *uf, struct ufat_dispatch *d)
+{
+	uf->dispatch = d;
+}
+
+void ufat_set_map(struct ufat *uf, ufat_map_t map)
+{
+	uf->map = map;
+}
+
+#ifndef UFAT_READ_ONLY
+static inline uint8_t *wbq_data(const struct ufat_wbq *q, unsigned int i)
+{
+	return q->data + (i << q->log2_block_size);
+}
+
+static inline unsigned int wbq_slot(const struct ufat_wbq *q, unsigned int n)
+{
+	return (q->head + n) % q->capacity;
+}
+
+static int wbq_find(const struct ufat_wbq *q, const struct ufat_device *dev,
+		    ufat_block_t index)
+{
+	unsigned int n;
+
+	for (n = 0; n < q->count; n++) {
+		const unsigned int i = wbq_slot(q, n);
+
+		if (q->ent[i].dev == dev && q->ent[i].index == index)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Forget queued copies of blocks which are about to be overwritten */
+static void wbq_discard(struct ufat_wbq *q, const struct ufat_device *dev,
+			ufat_block_t start, ufat_block_t count)
+{
+	unsigned int n;
+
+	for (n = 0; n < q->count; n++) {
+		struct ufat_wbq_entry *e = &q->ent[wbq_slot(q, n)];
+
+		if (e->dev == dev && e->index >= start &&
+		    e->index < start + count)
+			e->dev = NULL;
+	}
+}
+
+/* How many blocks are queued, up to and including the given slot? Draining
+ * this many writes out everything queued before the slot, and the slot
+ * itself, in FIFO order.
+ */
+static unsigned int wbq_live(const struct ufat_wbq *q, unsigned int slot)
+{
+	unsigned int live = 0;
+	unsigned int n;
+
+	for (n = 0; n < q->count; n++) {
+		const unsigned int i = wbq_slot(q, n);
+
+		if (q->ent[i].dev)
+			live++;
+
+		if (i == slot)
+			break;
+	}
+
+	return live;
+}
+
+int ufat_wbq_drain(struct ufat_wbq *q, unsigned int max_blocks)
+{
+	while (q->count) {
+		const unsigned int first = q->head;
+		const struct ufat_wbq_entry *e = &q->ent[first];
+		unsigned int run = 1;
+
+		/* Discarded entries cost nothing */
+		if (!e->dev) {
+			q->head = wbq_slot(q, 1);
+			q->count--;
+			continue;
+		}
+
+		if (!max_blocks)
+			return 1;
+
+		/* Coalesce with queued successors for the next blocks on the
+		 * same device, as long as the ring doesn't wrap.
+		 */
+		while (run < max_blocks && run < q->count &&
+		       first + run < q->capacity &&
+		       q->ent[first + run].dev == e->dev &&
+		       q->ent[first + run].index == e->index + run)
+			run++;
+
+		if (e->dev->write(e->dev, e->index, run,
+				  wbq_data(q, first)) < 0)
+			return -UFAT_ERR_IO;
+
+		q->head = wbq_slot(q, run);
+		q->count -= run;
+		max_blocks -= run;
+	}
+
+	return 0;
+}
+
+static int wbq_read(struct ufat_dispatch *d, const struct ufat_device *dev,
+		    ufat_io_class_t cls, ufat_block_t start,
+		    ufat_block_t count, void *buffer)
+{
+	struct ufat_wbq *q = (struct ufat_wbq *)d;
+	ufat_block_t i;
+
+	(void)cls;
+
+	/* A single queued block can be returned without waiting for the
+	 * device at all.
+	 */
+	if (count == 1) {
+		const int j = wbq_find(q, dev, start);
+
+		if (j >= 0) {
+			memcpy(buffer, wbq_data(q, j),
+			       1 << q->log2_block_size);
+			return 0;
+		}
+	}
+
+	if (dev->read(dev, start, count, buffer) < 0)
+		return -1;
+
+	/* Reads are served ahead of queued writes, so the device may still
+	 * hold stale copies of some blocks.
+	 */
+	for (i = 0; i < count && q->count; i++) {
+		const int j = wbq_find(q, dev, start + i);
+
+		if (j >= 0)
+			memcpy((uint8_t *)buffer + (i << q->log2_block_size),
+			       wbq_data(q, j), 1 << q->log2_block_size);
+	}
+
+	return 0;
+}
+
+static int wbq_write(struct ufat_dispatch *d, const struct ufat_device *dev,
+		     ufat_io_class_t cls, ufat_block_t start,
+		     ufat_block_t count, const void *buffer)
+{
+	struct ufat_wbq *q = (struct ufat_wbq *)d;
+	ufat_block_t i;
+
+	/* Only write-back is deferred. Anything else goes straight to the
+	 * device, and supersedes any queued copies.
+	 */
+	if (cls != UFAT_IO_WRITEBACK) {
+		wbq_discard(q, dev, start, count);
+		return dev->write(dev, start, count, buffer);
+	}
+
+	for (i = 0; i < count; i++) {
+		int j = wbq_find(q, dev, start + i);
+
+		/* A queued block can only be updated in place if it's the
+		 * newest entry. Otherwise, the update would reach the device
+		 * ahead of blocks queued since, which may depend on its old
+		 * contents. Write out the old copy first.
+		 */
+		if (j >= 0 && (unsigned int)j != wbq_slot(q, q->count - 1)) {
+			if (ufat_wbq_drain(q, wbq_live(q, j)) < 0)
+				return -1;
+
+			j = -1;
+		}
+
+		if (j < 0) {
+			if (q->count >= q->capacity &&
+			    ufat_wbq_drain(q, 1) < 0)
+				return -1;
+
+			j = wbq_slot(q, q->count);
+			q->ent[j].dev = dev;
+			q->ent[j].index = start + i;
+			q->count++;
+		}
+
+		memcpy(wbq_data(q, j),
+		       (const uint8_t *)buffer + (i << q->log2_block_size),
+		       1 << q->log2_block_size);
+	}
+
+	return 0;
+}
+
+static int wbq_sync(struct ufat_dispatch *d)
+{
+	return ufat_wbq_drain((struct ufat_wbq *)d, ~0u) < 0 ? -1 : 0;
+}
+
+void ufat_wbq_init(struct ufat_wbq *q, unsigned int log2_block_size,
+		   struct ufat_wbq_entry *ent, uint8_t *data,
+		   unsigned int capacity)
+{
+	q->base.read = wbq_read;
+	q->base.write = wbq_write;
+	q->base.sync = wbq_sync;
+
+	q->log2_block_size = log2_block_size;
+	q->capacity = capacity;
+	q->head = 0;
+	q->count = 0;
+	q->ent = ent;
+	q->data = data;
+}
+#endif
@@ -0,0 +1,296 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* std::streambuf adapter for uFAT files.
+ *
+ * The buffer is supplied by the caller, so that nothing is allocated. It
+ * holds a window onto the file whose size is the cluster size, or the
+ * largest power of two which fits if the buffer is smaller, and which is
+ * aligned to its own size. A window therefore never crosses a cluster
+ * boundary, and a full window is transferred by a single whole-block read
+ * or write which bypasses the cache.
+ */
+
+#ifndef UFAT_STREAM_HPP_
+#define UFAT_STREAM_HPP_
+
+#include <streambuf>
+#include "ufat.hpp"
+
+namespace ufatpp {
+
+class filebuf : public std::streambuf {
+public:
+	filebuf() noexcept = default;
+	~filebuf() override { close(); }
+
+	filebuf(const filebuf &) = delete;
+	filebuf &operator=(const filebuf &) = delete;
+
+	/**
+	 * Opens a file, using `buf` as the stream buffer. The buffer must
+	 * remain valid until the file is closed. For whole-block transfers,
+	 * it should hold at least one cluster.
+	 */
+	int open(volume &v, const ufat_dirent &ent, byte_span buf) noexcept
+	{
+		const struct ufat *uf = v.get();
+		std::size_t size = (std::size_t)1 <<
+			(uf->dev->log2_block_size +
+			 uf->bpb.log2_blocks_per_cluster);
+
+		close();
+
+		while (size > buf.size())
+			size >>= 1;
+		if (!size)
+			return -UFAT_ERR_BLOCK_SIZE;
+
+		const int err = file_.open(v, ent);
+
+		if (err < 0)
+			return err;
+
+		buf_ = buf.data();
+		win_size_ = size;
+		win_pos_ = 0;
+		err_ = 0;
+		return 0;
+	}
+
+	/** Writes out buffered data and closes the file. */
+	int close() noexcept
+	{
+		int err = 0;
+
+		if (file_.is_open())
+			err = release();
+
+		file_ = file();
+		buf_ = nullptr;
+		return err;
+	}
+
+	bool is_open() const noexcept { return file_.is_open(); }
+
+	/**
+	 * Returns the error which caused the last failure reported to the
+	 * stream, or 0 if there hasn't been one.
+	 */
+	int error() const noexcept { return err_; }
+
+	/** Returns the window size chosen when the file was opened. */
+	std::size_t window_size() const noexcept { return win_size_; }
+
+	ufat_file *get() noexcept { return file_.get(); }
+
+protected:
+	int_type underflow() override
+	{
+		if (!file_.is_open() || release() < 0)
+			return traits_type::eof();
+
+		const ufat_size_t pos = win_pos_;
+		const ufat_size_t start = window_start(pos);
+		int len = file_.seek(start);
+
+		if (len >= 0)
+			len = file_.read(byte_span(buf_, win_size_));
+		if (len < 0) {
+			err_ = len;
+			return traits_type::eof();
+		}
+
+		win_pos_ = start;
+		setg(buf_, buf_ + (pos - start), buf_ + len);
+
+		if (gptr() == egptr())
+			return traits_type::eof();
+
+		return traits_type::to_int_type(*gptr());
+	}
+
+	int_type overflow(int_type c) override
+	{
+#ifdef UFAT_READ_ONLY
+		(void)c;
+		return traits_type::eof();
+#else
+		if (!file_.is_open() || release() < 0)
+			return traits_type::eof();
+
+		const ufat_size_t pos = win_pos_;
+		const ufat_size_t start = window_start(pos);
+
+		win_pos_ = start;
+		setp(buf_ + (pos - start), buf_ + win_size_);
+
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+
+		return traits_type::not_eof(c);
+#endif
+	}
+
+	int sync() override
+	{
+		return flush() < 0 ? -1 : 0;
+	}
+
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+			 std::ios_base::openmode) override
+	{
+		const pos_type fail = pos_type(off_type(-1));
+
+		if (!file_.is_open())
+			return fail;
+
+		/* Reporting the position leaves the buffer alone */
+		if (!off && dir == std::ios_base::cur)
+			return pos_type(off_type(position()));
+
+		/* So does moving within the data already read */
+		if (eback() && dir != std::ios_base::end) {
+			const off_type target = off + (dir == std::ios_base::cur ?
+				off_type(position()) : 0);
+
+			if (target >= off_type(win_pos_) &&
+			    target <= off_type(win_pos_ + (egptr() - buf_))) {
+				setg(eback(), buf_ + (target - win_pos_),
+				     egptr());
+				return pos_type(target);
+			}
+		}
+
+		if (release() < 0)
+			return fail;
+
+		off_type target = off;
+
+		if (dir == std::ios_base::cur)
+			target += win_pos_;
+		else if (dir == std::ios_base::end)
+			target += file_.size();
+
+		if (target < 0 || target > off_type(file_.size()))
+			return fail;
+
+		/* Find the cluster now. The window which is read or written
+		 * next starts in the same cluster, so no further lookup is
+		 * needed.
+		 */
+		const int err = file_.seek(target);
+
+		if (err < 0) {
+			err_ = err;
+			return fail;
+		}
+
+		win_pos_ = target;
+		return pos_type(target);
+	}
+
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+	{
+		return seekoff(off_type(pos), std::ios_base::beg, which);
+	}
+
+private:
+	ufat_size_t window_start(ufat_size_t pos) const noexcept
+	{
+		return pos & ~(ufat_size_t)(win_size_ - 1);
+	}
+
+	/* The stream position. When neither area is in use, it's held in
+	 * win_pos_.
+	 */
+	ufat_size_t position() const noexcept
+	{
+		if (pbase())
+			return win_pos_ + (pptr() - buf_);
+		if (eback())
+			return win_pos_ + (gptr() - buf_);
+
+		return win_pos_;
+	}
+
+	/* Writes out the put area. Writing continues from where it left
+	 * off, within the same window.
+	 */
+	int flush() noexcept
+	{
+#ifndef UFAT_READ_ONLY
+		if (pbase() == pptr())
+			return 0;
+
+		int err = file_.seek(win_pos_ + (pbase() - buf_));
+
+		if (err >= 0)
+			err = file_.write(const_byte_span(pbase(),
+						pptr() - pbase()));
+
+		setp(pptr(), epptr());
+
+		if (err < 0) {
+			err_ = err;
+			return err;
+		}
+#endif
+		return 0;
+	}
+
+	/* Writes out the put area and gives up both areas */
+	int release() noexcept
+	{
+		const ufat_size_t pos = position();
+		const int err = flush();
+
+		setg(nullptr, nullptr, nullptr);
+		setp(nullptr, nullptr);
+		win_pos_ = pos;
+
+		return err;
+	}
+
+	file		file_;
+	char		*buf_ = nullptr;
+	std::size_t	win_size_ = 0;
+	ufat_size_t	win_pos_ = 0;
+	int		err_ = 0;
+};
+
+} // namespace ufatpp
+
+#endif
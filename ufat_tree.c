@@ -0,0 +1,278 @@
+/* uFAT -- small flexible VFAT implementation
+ * Copyright (C) 2012 TracMap Holdings Ltd
+ *
+ * Author: Daniel Beer <dlbeer@gmail.com>, www.dlbeer.co.nz
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "ufat.h"
+#include "ufat_internal.h"
+
+#if UFAT_TREE_DEPTH < 1
+#error UFAT_TREE_DEPTH must be at least 1
+#endif
+
+/* One level of a tree walk: an iterator, and the directory's first cluster.
+ * Levels below UFAT_TREE_DEPTH share the last frame.
+ */
+struct tree_frame {
+	struct ufat_directory	dir;
+	ufat_cluster_t		start;
+};
+
+static inline struct tree_frame *frame_at(struct tree_frame *frames,
+					  unsigned int depth)
+{
+	return &frames[depth < UFAT_TREE_DEPTH ? depth : UFAT_TREE_DEPTH - 1];
+}
+
+/* A start cluster of 0 (as in ".." entries) means the root directory */
+static void open_frame(struct ufat *uf, struct tree_frame *f,
+		       ufat_cluster_t start)
+{
+	if (!start)
+		start = uf->bpb.root_cluster;
+
+	f->start = start;
+
+	if (!start || start == uf->bpb.root_cluster) {
+		ufat_open_root(uf, &f->dir);
+		return;
+	}
+
+	f->dir.uf = uf;
+	f->dir.start = cluster_to_block(&uf->bpb, start);
+	f->dir.cur_block = f->dir.start;
+	f->dir.cur_pos = 0;
+}
+
+/* The frame holds a finished directory whose parent's frame has been
+ * reused. Reopen the parent, found by the ".." entry, and move its
+ * iterator past the entry for the child.
+ */
+static int resume_parent(struct ufat *uf, struct tree_frame *f)
+{
+	const ufat_cluster_t child = f->start;
+	uint8_t data[UFAT_DIRENT_SIZE];
+	struct ufat_dirent e;
+	int err;
+
+	f->dir.cur_block = f->dir.start;
+	f->dir.cur_pos = 1;
+
+	err = ufat_read_raw_dirent(&f->dir, data);
+	if (err < 0)
+		return err;
+
+	if (err || data[0] != '.' || data[1] != '.')
+		return -UFAT_ERR_INVALID_CLUSTER;
+
+	ufat_parse_dirent(uf->bpb.type, data, &e);
+	if (e.first_cluster && !UFAT_CLUSTER_IS_PTR(e.first_cluster))
+		return -UFAT_ERR_INVALID_CLUSTER;
+
+	open_frame(uf, f, e.first_cluster);
+
+	for (;;) {
+		err = ufat_dir_read(&f->dir, &e, NULL, 0);
+		if (err < 0)
+			return err;
+
+		if (err)
+			return -UFAT_ERR_INVALID_CLUSTER;
+
+		if ((e.attributes & UFAT_ATTR_DIRECTORY) &&
+		    e.first_cluster == child)
+			return 0;
+	}
+}
+
+#ifndef UFAT_READ_ONLY
+int ufat_remove_tree(struct ufat *uf, struct ufat_dirent *ent)
+{
+	struct tree_frame frames[UFAT_TREE_DEPTH];
+	unsigned int depth = 0;
+	int err;
+
+	if (!(ent->attributes & UFAT_ATTR_DIRECTORY))
+		return ufat_dir_delete(uf, ent);
+
+	if (ent->dirent_block == UFAT_BLOCK_NONE || ent->short_name[0] == '.')
+		return -UFAT_ERR_IMMUTABLE;
+
+	/* Unlink the tree. Its directories are freed without being modified,
+	 * so the entry is the only thing written outside the FAT.
+	 */
+	err = ufat_delete_entry(uf, ent);
+	if (err < 0)
+		return err;
+
+	ufat_cache_barrier(uf);
+
+	if (!UFAT_CLUSTER_IS_PTR(ent->first_cluster))
+		return 0;
+
+	open_frame(uf, &frames[0], ent->first_cluster);
+
+	for (;;) {
+		struct tree_frame *f = frame_at(frames, depth);
+		struct ufat_dirent e;
+		ufat_cluster_t done;
+
+		err = ufat_dir_read(&f->dir, &e, NULL, 0);
+		if (err < 0)
+			return err;
+
+		if (!err) {
+			if (e.short_name[0] == '.' ||
+			    !UFAT_CLUSTER_IS_PTR(e.first_cluster))
+				continue;
+
+			if (!(e.attributes & UFAT_ATTR_DIRECTORY)) {
+				err = ufat_free_chain(uf, e.first_cluster);
+				if (err < 0)
+					return err;
+
+				continue;
+			}
+
+			depth++;
+			open_frame(uf, frame_at(frames, depth), e.first_cluster);
+			continue;
+		}
+
+		/* The directory is finished, and its chain can go. Its
+		 * parent is needed first if it's not on the stack.
+		 */
+		done = f->start;
+
+		if (depth >= UFAT_TREE_DEPTH) {
+			err = resume_parent(uf, f);
+			if (err < 0)
+				return err;
+		}
+
+		err = ufat_free_chain(uf, done);
+		if (err < 0 || !depth)
+			return err;
+
+		depth--;
+	}
+}
+#endif
+
+static int add_chain(struct ufat *uf, ufat_cluster_t start,
+		     ufat_cluster_t *total)
+{
+	ufat_cluster_t n;
+	const int err = ufat_chain_length(uf, start, &n);
+
+	if (err < 0)
+		return err;
+
+	*total += n;
+	return 0;
+}
+
+int ufat_tree_usage(struct ufat *uf, const struct ufat_dirent *ent,
+		    struct ufat_usage *u)
+{
+	struct tree_frame frames[UFAT_TREE_DEPTH];
+	unsigned int depth = 0;
+	int err;
+
+	memset(u, 0, sizeof(*u));
+
+	if (ent && !(ent->attributes & UFAT_ATTR_DIRECTORY)) {
+		u->files = 1;
+		u->logical_bytes = ent->file_size;
+		return add_chain(uf, ent->first_cluster, &u->file_clusters);
+	}
+
+	open_frame(uf, &frames[0],
+		   (ent && ent->dirent_block != UFAT_BLOCK_NONE) ?
+		   ent->first_cluster : 0);
+	u->directories = 1;
+
+	err = add_chain(uf, frames[0].start, &u->dir_clusters);
+	if (err < 0)
+		return err;
+
+	for (;;) {
+		struct tree_frame *f = frame_at(frames, depth);
+		struct ufat_dirent e;
+
+		err = ufat_dir_read(&f->dir, &e, NULL, 0);
+		if (err < 0)
+			return err;
+
+		if (!err) {
+			if (e.short_name[0] == '.')
+				continue;
+
+			if (!(e.attributes & UFAT_ATTR_DIRECTORY)) {
+				u->files++;
+				u->logical_bytes += e.file_size;
+
+				err = add_chain(uf, e.first_cluster,
+						&u->file_clusters);
+				if (err < 0)
+					return err;
+
+				continue;
+			}
+
+			if (!UFAT_CLUSTER_IS_PTR(e.first_cluster))
+				continue;
+
+			u->directories++;
+
+			err = add_chain(uf, e.first_cluster,
+					&u->dir_clusters);
+			if (err < 0)
+				return err;
+
+			depth++;
+			open_frame(uf, frame_at(frames, depth), e.first_cluster);
+			continue;
+		}
+
+		if (!depth)
+			return 0;
+
+		if (depth >= UFAT_TREE_DEPTH) {
+			err = resume_parent(uf, f);
+			if (err < 0)
+				return err;
+		}
+
+		depth--;
+	}
+}